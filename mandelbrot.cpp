@@ -3,6 +3,30 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <complex>
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define X86_SIMD
+#endif
 
 const GLchar* vertexSource = R"glsl(
     #version 150 core
@@ -17,30 +41,233 @@ const GLchar* vertexSource = R"glsl(
     }
 )glsl";
 
+// The escape shader writes one float per pixel for the composite to colour:
+// -1 for points that never escape, otherwise the escape count for
+// COLOR_GRAY, the continuous count for the palettes and the distance to the
+// set in pixels for COLOR_DISTANCE.
+enum Coloring {
+    COLOR_GRAY,
+    COLOR_SMOOTH,
+    COLOR_EQUALIZED,
+    COLOR_DISTANCE
+};
+
+const char* coloringNames[] = { "gray", "smooth", "equalized", "distance" };
+
 const GLchar* fragmentSource = R"glsl(
     #version 150 core
     in vec2 Position;
 
     out vec4 outColor;
 
+    uniform vec2 center;
+    uniform float scale;
+    uniform int maxIter;
+    uniform int coloring; // a Coloring
+    uniform float pixelSize;
+
     void main()
     {
         //outColor = vec4(0.5,0.0,0.0,1.0);
-        float x = 2 * Position.x;
-        float y = 2 * Position.y;
+        float x = center.x + scale * Position.x;
+        float y = center.y + scale * Position.y;
+        // the main cardioid and the period-2 bulb never escape
+        float xq = x - 0.25;
+        float q = xq*xq + y*y;
+        if (q * (q + xq) <= 0.25*y*y || (x + 1.0)*(x + 1.0) + y*y <= 0.0625) {
+            outColor = vec4(-1.0, 0.0, 0.0, 1.0);
+            return;
+        }
         float r = 0;
         float i = 0;
-        for (int j = 0; j < 30; j++) {
+        float dr = 0;
+        float di = 0;
+        float savedR = 0;
+        float savedI = 0;
+        int saveAt = 1;
+        for (int j = 0; j < maxIter; j++) {
+            if (coloring == 3) {
+                float newdr = 2*(r*dr - i*di) + 1;
+                di = 2*(r*di + i*dr);
+                dr = newdr;
+            }
             float newx = r*r - i*i + x;
             float newy = 2*r*i + y;
             r = newx;
             i = newy;
-            if (r > 2.0 || r < -2.0 || i > 2.0 || i < -2.0) {
-                outColor = vec4(1.0 - j / 40.0, 1.0 - j / 40.0, 1.0 - j / 40.0, 1.0);
+            // back on a value seen before, so on a cycle that never escapes;
+            // the tolerance is the CPU kernels' periodEpsilon for float
+            if ((r - savedR)*(r - savedR) + (i - savedI)*(i - savedI) < 1e-10) break;
+            if (j == saveAt) {
+                savedR = r;
+                savedI = i;
+                saveAt *= 2;
+            }
+            if (coloring == 0) {
+                if (r > 2.0 || r < -2.0 || i > 2.0 || i < -2.0) {
+                    outColor = vec4(j, 0.0, 0.0, 1.0);
+                    return;
+                }
+                continue;
+            }
+            float m = r*r + i*i;
+            if (coloring == 3 && m > 1024.0) {
+                float d = 0.5 * log(m) * sqrt(m) / length(vec2(dr, di));
+                outColor = vec4(d / pixelSize, 0.0, 0.0, 1.0);
                 return;
             }
+            // the continuous count, which past |z| = 16 hardly depends on
+            // where the orbit crossed the circle
+            if (coloring != 3 && m > 256.0) {
+                outColor = vec4(max(j + 1.0 - log2(0.5 * log2(m)), 0.0), 0.0, 0.0, 1.0);
+                return;
+            }
+        }
+        outColor = vec4(-1.0, 0.0, 0.0, 1.0);
+    }
+)glsl";
+
+// Moves the last displayed frame to the current view. Pixels that were not
+// on screen come out with alpha 0; alpha otherwise encodes how coarse the
+// pixel is, see compositeFSource.
+const GLchar* reprojectFSource = R"glsl(
+    #version 150 core
+    in vec2 Position;
+
+    out vec4 outColor;
+
+    uniform sampler2D previous;
+    uniform vec2 center;
+    uniform float scale;
+    uniform vec2 previousCenter;
+    uniform float previousScale;
+
+    void main()
+    {
+        vec2 uv = (center + scale * Position - previousCenter) / previousScale * 0.5 + 0.5;
+        if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0)))) {
+            outColor = vec4(0.0);
+            return;
+        }
+        vec4 texel = texture(previous, uv);
+        if (texel.a == 0.0) {
+            outColor = vec4(0.0);
+            return;
+        }
+        // each doubling of magnification makes the old pixels a level coarser
+        float shift = clamp(9.0 - texel.a * 9.0 + log2(previousScale / scale), 0.0, 8.0);
+        outColor = vec4(texel.rgb, (9.0 - shift) / 9.0);
+    }
+)glsl";
+
+// Picks per pixel between the refinement levels finished so far and the
+// reprojected last frame, whichever is finer. Level k is drawn at 1 / 2^(3-k)
+// resolution; alpha stores (9 - shift) / 9 for a pixel 2^shift screen pixels
+// wide, and 0 where there is nothing yet.
+const GLchar* compositeFSource = R"glsl(
+    #version 150 core
+    in vec2 Position;
+
+    out vec4 outColor;
+
+    uniform sampler2D level0;
+    uniform sampler2D level1;
+    uniform sampler2D level2;
+    uniform sampler2D level3;
+    uniform sampler2D reprojected;
+    uniform int refining; // the level being drawn, 4 once all are done
+    uniform float refinedRows; // fraction of its rows done, from the bottom
+    uniform int coloring;
+    uniform sampler1D palette;
+    uniform sampler2D cdf; // running histogram total per bin, see histogramVSource
+    uniform int bins;
+    uniform float logMax;
+
+    vec3 shade(float value)
+    {
+        if (value < 0.0) return vec3(0.0);
+        if (coloring == 0) return vec3(1.0 - value / 40.0);
+        if (coloring == 3) return vec3(sqrt(clamp(value / 4.0, 0.0, 1.0)));
+        float total = texelFetch(cdf, ivec2(bins - 1, 0), 0).r;
+        if (coloring == 1 || total == 0.0) return texture(palette, value / 64.0).rgb;
+        // the share of pixels below value, interpolated within its bin
+        float f = min(log2(1.0 + value) / logMax, 1.0) * bins;
+        int bin = min(int(f), bins - 1);
+        float below = bin > 0 ? texelFetch(cdf, ivec2(bin - 1, 0), 0).r : 0.0;
+        float upTo = texelFetch(cdf, ivec2(bin, 0), 0).r;
+        return texture(palette, mix(below, upTo, f - bin) / total).rgb;
+    }
+
+    float levelValue(int level, vec2 uv)
+    {
+        if (level == 0) return texture(level0, uv).r;
+        if (level == 1) return texture(level1, uv).r;
+        if (level == 2) return texture(level2, uv).r;
+        return texture(level3, uv).r;
+    }
+
+    void main()
+    {
+        vec2 uv = Position * 0.5 + 0.5;
+        int best = min(uv.y < refinedRows ? refining : refining - 1, 3);
+        vec4 old = texture(reprojected, uv);
+        float shift = float(3 - best);
+        if (best >= 0 && (old.a == 0.0 || shift <= 9.0 - old.a * 9.0 + 0.01)) {
+            outColor = vec4(shade(levelValue(best, uv)), (9.0 - shift) / 9.0);
+        }
+        else {
+            outColor = old;
         }
-        outColor = vec4(0.0, 0.0, 0.0, 1.0);
+    }
+)glsl";
+
+// Histogram equalization. One point per sampled pixel of a level, every
+// stride-th in each direction and read back by gl_VertexID, lands on the bin
+// of its continuous count and adds 1 there with additive blending. Bins are
+// logarithmic in the count up to the level's iterations, so deep views,
+// whose counts bunch far from 0, still spread over many of them.
+const GLchar* histogramVSource = R"glsl(
+    #version 150 core
+    uniform sampler2D values;
+    uniform int stride;
+    uniform int bins;
+    uniform float logMax;
+
+    void main()
+    {
+        int columns = textureSize(values, 0).x / stride;
+        float value = texelFetch(values, ivec2(gl_VertexID % columns, gl_VertexID / columns) * stride, 0).r;
+        int bin = min(int(log2(1.0 + value) / logMax * bins), bins - 1);
+        // points that never escape fall outside the target
+        gl_Position = vec4(value < 0.0 ? 2.0 : (bin + 0.5) / bins * 2.0 - 1.0, 0.0, 0.0, 1.0);
+    }
+)glsl";
+
+const GLchar* histogramFSource = R"glsl(
+    #version 150 core
+    out vec4 outColor;
+
+    void main()
+    {
+        outColor = vec4(1.0);
+    }
+)glsl";
+
+// One step of a Hillis-Steele inclusive prefix sum over the bins: log2(bins)
+// steps with offset 1, 2, 4... turn the histogram into running totals.
+const GLchar* scanFSource = R"glsl(
+    #version 150 core
+    out vec4 outColor;
+
+    uniform sampler2D partial;
+    uniform int offset;
+
+    void main()
+    {
+        int bin = int(gl_FragCoord.x);
+        float sum = texelFetch(partial, ivec2(bin, 0), 0).r;
+        if (bin >= offset) sum += texelFetch(partial, ivec2(bin - offset, 0), 0).r;
+        outColor = vec4(sum, 0.0, 0.0, 1.0);
     }
 )glsl";
 
@@ -62,13 +289,1784 @@ GLuint makeShader(GLenum type, const GLchar* source) {
     return id;
 }
 
+// A view of the set as the CPU renderer sees it. Pixel centres map to
+// Position in [-1, 1] like the fragment shader's, and c = center + scale *
+// Position, so center (0, 0) and scale 2 give the shader's x = 2 * Position.x.
+struct CpuView {
+    int width, height;
+    int maxIter;
+    double centerX, centerY;
+    double scale;
+    bool skipInterior; // see insideMainBulbs and the periodicity check
+};
+
+// Escape counts are stored top row first. A count of maxIter means the point
+// never left the box, like the shader's fall-through to black.
+double pixelX(const CpuView &view, int x) {
+    return view.centerX + view.scale * (2.0 * (x + 0.5) / view.width - 1.0);
+}
+
+double pixelY(const CpuView &view, int row) {
+    return view.centerY + view.scale * (1.0 - 2.0 * (row + 0.5) / view.height);
+}
+
+// Interior points are the expensive ones, running to maxIter. Those in the
+// main cardioid or the period-2 bulb are known without iterating.
+template <typename T>
+bool insideMainBulbs(T x, T y) {
+    T xq = x - (T) 0.25;
+    T q = xq * xq + y * y;
+    return q * (q + xq) <= (T) 0.25 * y * y || (x + 1) * (x + 1) + y * y <= (T) 0.0625;
+}
+
+// Squared distance at which z counts as back on the saved value: |dz| below
+// 1e-5 in float and 1e-13 in double, roughly 80 and 450 ulps at |z| = 1.
+// An orbit on an attracting cycle closes in on it geometrically but, near
+// the edge of its component, may keep wandering in the last bits instead of
+// landing on an exact repeat; the tolerance catches those. The price is that
+// an exterior point whose orbit passes this close to a saved value before
+// escaping is taken for interior. runInteriorBenchmark counts such pixels.
+template <typename T>
+T periodEpsilon();
+
+template <>
+float periodEpsilon<float>() { return 1e-10f; }
+
+template <>
+double periodEpsilon<double>() { return 1e-26; }
+
+template <typename T>
+bool nearSaved(T r, T i, T savedR, T savedI) {
+    T dr = r - savedR;
+    T di = i - savedI;
+    return dr * dr + di * di < periodEpsilon<T>();
+}
+
+// The shader's iteration: z = z^2 + c from z = 0, stopping once either
+// component leaves [-2, 2]. With skipInterior, Brent's periodicity check
+// saves z at iterations 1, 2, 4, 8... and stops when z comes back within
+// periodEpsilon of the saved value: the orbit has settled onto a cycle that
+// never escapes, so the count is maxIter, as running on would have found.
+// Interior orbits of the other components usually get there long before
+// maxIter.
+template <typename T>
+void escapeRowScalar(const CpuView &view, int row, int x0, int x1, int* counts) {
+    T y = (T) pixelY(view, row);
+    for (int px = x0; px < x1; px++) {
+        T x = (T) pixelX(view, px);
+        if (view.skipInterior && insideMainBulbs(x, y)) {
+            counts[px] = view.maxIter;
+            continue;
+        }
+        T r = 0;
+        T i = 0;
+        T savedR = 0;
+        T savedI = 0;
+        int saveAt = 1;
+        int count = view.maxIter;
+        for (int j = 0; j < view.maxIter; j++) {
+            T newx = r * r - i * i + x;
+            T newy = 2 * r * i + y;
+            r = newx;
+            i = newy;
+            if (view.skipInterior) {
+                if (nearSaved(r, i, savedR, savedI)) break;
+                if (j == saveAt) {
+                    savedR = r;
+                    savedI = i;
+                    saveAt *= 2;
+                }
+            }
+            if (r > 2 || r < -2 || i > 2 || i < -2) {
+                count = j;
+                break;
+            }
+        }
+        counts[px] = count;
+    }
+}
+
+#ifdef X86_SIMD
+// The SIMD rows run the same iteration on a group of pixels at once. Lanes
+// that escape drop out of the active mask, which is all the bookkeeping the
+// loop needs: a lane escapes once, so its count is written from the mask bits
+// right then, and the group stops as soon as no lane is left. Lanes past x1
+// start inactive, and so do lanes insideMainBulbs settles; the periodicity
+// check retires lanes the same way. Escaped lanes keep iterating harmlessly
+// until then. The Makefile passes -ffp-contract=off so the compiler does not
+// fuse the AVX-512 multiplies and adds, which keeps every kernel
+// bit-identical to the scalar one.
+__attribute__((target("avx2")))
+void escapeRowAvx2Float(const CpuView &view, int row, int x0, int x1, int* counts) {
+    const __m256 cy = _mm256_set1_ps((float) pixelY(view, row));
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 epsilon = _mm256_set1_ps(periodEpsilon<float>());
+    for (int px = x0; px < x1; px += 8) {
+        float xs[8];
+        for (int l = 0; l < 8; l++) xs[l] = (float) pixelX(view, px + l);
+        int lanes = std::min(8, x1 - px);
+        int active = (1 << lanes) - 1;
+        for (int l = 0; l < lanes; l++) counts[px + l] = view.maxIter;
+        if (view.skipInterior) {
+            float y = (float) pixelY(view, row);
+            for (int l = 0; l < lanes; l++) {
+                if (insideMainBulbs(xs[l], y)) active &= ~(1 << l);
+            }
+            if (!active) continue;
+        }
+        __m256 cx = _mm256_loadu_ps(xs);
+        __m256 r = _mm256_setzero_ps();
+        __m256 i = _mm256_setzero_ps();
+        __m256 savedR = r;
+        __m256 savedI = i;
+        int saveAt = 1;
+        for (int j = 0; j < view.maxIter; j++) {
+            __m256 newx = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(r, r), _mm256_mul_ps(i, i)), cx);
+            __m256 newy = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(two, r), i), cy);
+            r = newx;
+            i = newy;
+            if (view.skipInterior) {
+                __m256 dr = _mm256_sub_ps(r, savedR);
+                __m256 di = _mm256_sub_ps(i, savedI);
+                __m256 distance = _mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(di, di));
+                active &= ~_mm256_movemask_ps(_mm256_cmp_ps(distance, epsilon, _CMP_LT_OQ));
+                if (!active) break;
+                if (j == saveAt) {
+                    savedR = r;
+                    savedI = i;
+                    saveAt *= 2;
+                }
+            }
+            __m256 out = _mm256_or_ps(_mm256_cmp_ps(_mm256_and_ps(r, absMask), two, _CMP_GT_OQ),
+                _mm256_cmp_ps(_mm256_and_ps(i, absMask), two, _CMP_GT_OQ));
+            int escaped = _mm256_movemask_ps(out) & active;
+            if (!escaped) continue;
+            for (int l = 0; l < 8; l++) {
+                if (escaped & (1 << l)) counts[px + l] = j;
+            }
+            active &= ~escaped;
+            if (!active) break;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void escapeRowAvx2Double(const CpuView &view, int row, int x0, int x1, int* counts) {
+    const __m256d cy = _mm256_set1_pd(pixelY(view, row));
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+    const __m256d epsilon = _mm256_set1_pd(periodEpsilon<double>());
+    for (int px = x0; px < x1; px += 4) {
+        double xs[4];
+        for (int l = 0; l < 4; l++) xs[l] = pixelX(view, px + l);
+        int lanes = std::min(4, x1 - px);
+        int active = (1 << lanes) - 1;
+        for (int l = 0; l < lanes; l++) counts[px + l] = view.maxIter;
+        if (view.skipInterior) {
+            double y = pixelY(view, row);
+            for (int l = 0; l < lanes; l++) {
+                if (insideMainBulbs(xs[l], y)) active &= ~(1 << l);
+            }
+            if (!active) continue;
+        }
+        __m256d cx = _mm256_loadu_pd(xs);
+        __m256d r = _mm256_setzero_pd();
+        __m256d i = _mm256_setzero_pd();
+        __m256d savedR = r;
+        __m256d savedI = i;
+        int saveAt = 1;
+        for (int j = 0; j < view.maxIter; j++) {
+            __m256d newx = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(r, r), _mm256_mul_pd(i, i)), cx);
+            __m256d newy = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, r), i), cy);
+            r = newx;
+            i = newy;
+            if (view.skipInterior) {
+                __m256d dr = _mm256_sub_pd(r, savedR);
+                __m256d di = _mm256_sub_pd(i, savedI);
+                __m256d distance = _mm256_add_pd(_mm256_mul_pd(dr, dr), _mm256_mul_pd(di, di));
+                active &= ~_mm256_movemask_pd(_mm256_cmp_pd(distance, epsilon, _CMP_LT_OQ));
+                if (!active) break;
+                if (j == saveAt) {
+                    savedR = r;
+                    savedI = i;
+                    saveAt *= 2;
+                }
+            }
+            __m256d out = _mm256_or_pd(_mm256_cmp_pd(_mm256_and_pd(r, absMask), two, _CMP_GT_OQ),
+                _mm256_cmp_pd(_mm256_and_pd(i, absMask), two, _CMP_GT_OQ));
+            int escaped = _mm256_movemask_pd(out) & active;
+            if (!escaped) continue;
+            for (int l = 0; l < 4; l++) {
+                if (escaped & (1 << l)) counts[px + l] = j;
+            }
+            active &= ~escaped;
+            if (!active) break;
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+void escapeRowAvx512Float(const CpuView &view, int row, int x0, int x1, int* counts) {
+    const __m512 cy = _mm512_set1_ps((float) pixelY(view, row));
+    const __m512 two = _mm512_set1_ps(2.0f);
+    const __m512 epsilon = _mm512_set1_ps(periodEpsilon<float>());
+    for (int px = x0; px < x1; px += 16) {
+        float xs[16];
+        for (int l = 0; l < 16; l++) xs[l] = (float) pixelX(view, px + l);
+        int lanes = std::min(16, x1 - px);
+        __mmask16 active = (__mmask16) ((1 << lanes) - 1);
+        for (int l = 0; l < lanes; l++) counts[px + l] = view.maxIter;
+        if (view.skipInterior) {
+            float y = (float) pixelY(view, row);
+            for (int l = 0; l < lanes; l++) {
+                if (insideMainBulbs(xs[l], y)) active &= ~(1 << l);
+            }
+            if (!active) continue;
+        }
+        __m512 cx = _mm512_loadu_ps(xs);
+        __m512 r = _mm512_setzero_ps();
+        __m512 i = _mm512_setzero_ps();
+        __m512 savedR = r;
+        __m512 savedI = i;
+        int saveAt = 1;
+        for (int j = 0; j < view.maxIter; j++) {
+            __m512 newx = _mm512_add_ps(_mm512_sub_ps(_mm512_mul_ps(r, r), _mm512_mul_ps(i, i)), cx);
+            __m512 newy = _mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(two, r), i), cy);
+            r = newx;
+            i = newy;
+            if (view.skipInterior) {
+                __m512 dr = _mm512_sub_ps(r, savedR);
+                __m512 di = _mm512_sub_ps(i, savedI);
+                __m512 distance = _mm512_add_ps(_mm512_mul_ps(dr, dr), _mm512_mul_ps(di, di));
+                active &= ~_mm512_cmp_ps_mask(distance, epsilon, _CMP_LT_OQ);
+                if (!active) break;
+                if (j == saveAt) {
+                    savedR = r;
+                    savedI = i;
+                    saveAt *= 2;
+                }
+            }
+            __mmask16 escaped = (_mm512_cmp_ps_mask(_mm512_abs_ps(r), two, _CMP_GT_OQ)
+                | _mm512_cmp_ps_mask(_mm512_abs_ps(i), two, _CMP_GT_OQ)) & active;
+            if (!escaped) continue;
+            for (int l = 0; l < 16; l++) {
+                if (escaped & (1 << l)) counts[px + l] = j;
+            }
+            active &= ~escaped;
+            if (!active) break;
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+void escapeRowAvx512Double(const CpuView &view, int row, int x0, int x1, int* counts) {
+    const __m512d cy = _mm512_set1_pd(pixelY(view, row));
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512d epsilon = _mm512_set1_pd(periodEpsilon<double>());
+    for (int px = x0; px < x1; px += 8) {
+        double xs[8];
+        for (int l = 0; l < 8; l++) xs[l] = pixelX(view, px + l);
+        int lanes = std::min(8, x1 - px);
+        __mmask8 active = (__mmask8) ((1 << lanes) - 1);
+        for (int l = 0; l < lanes; l++) counts[px + l] = view.maxIter;
+        if (view.skipInterior) {
+            double y = pixelY(view, row);
+            for (int l = 0; l < lanes; l++) {
+                if (insideMainBulbs(xs[l], y)) active &= ~(1 << l);
+            }
+            if (!active) continue;
+        }
+        __m512d cx = _mm512_loadu_pd(xs);
+        __m512d r = _mm512_setzero_pd();
+        __m512d i = _mm512_setzero_pd();
+        __m512d savedR = r;
+        __m512d savedI = i;
+        int saveAt = 1;
+        for (int j = 0; j < view.maxIter; j++) {
+            __m512d newx = _mm512_add_pd(_mm512_sub_pd(_mm512_mul_pd(r, r), _mm512_mul_pd(i, i)), cx);
+            __m512d newy = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two, r), i), cy);
+            r = newx;
+            i = newy;
+            if (view.skipInterior) {
+                __m512d dr = _mm512_sub_pd(r, savedR);
+                __m512d di = _mm512_sub_pd(i, savedI);
+                __m512d distance = _mm512_add_pd(_mm512_mul_pd(dr, dr), _mm512_mul_pd(di, di));
+                active &= ~_mm512_cmp_pd_mask(distance, epsilon, _CMP_LT_OQ);
+                if (!active) break;
+                if (j == saveAt) {
+                    savedR = r;
+                    savedI = i;
+                    saveAt *= 2;
+                }
+            }
+            __mmask8 escaped = (_mm512_cmp_pd_mask(_mm512_abs_pd(r), two, _CMP_GT_OQ)
+                | _mm512_cmp_pd_mask(_mm512_abs_pd(i), two, _CMP_GT_OQ)) & active;
+            if (!escaped) continue;
+            for (int l = 0; l < 8; l++) {
+                if (escaped & (1 << l)) counts[px + l] = j;
+            }
+            active &= ~escaped;
+            if (!active) break;
+        }
+    }
+}
+#endif
+
+enum CpuKernel {
+    KERNEL_SCALAR,
+    KERNEL_AVX2,
+    KERNEL_AVX512
+};
+
+const char* kernelNames[] = { "scalar", "avx2", "avx512" };
+
+// The widest kernel both this build and this CPU can run.
+CpuKernel detectKernel() {
+#ifdef X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return KERNEL_AVX512;
+    if (__builtin_cpu_supports("avx2")) return KERNEL_AVX2;
+#endif
+    return KERNEL_SCALAR;
+}
+
+typedef void (*EscapeRowFn)(const CpuView &view, int row, int x0, int x1, int* counts);
+
+EscapeRowFn escapeRowFunction(CpuKernel kernel, bool doublePrecision) {
+#ifdef X86_SIMD
+    if (kernel == KERNEL_AVX512) return doublePrecision ? escapeRowAvx512Double : escapeRowAvx512Float;
+    if (kernel == KERNEL_AVX2) return doublePrecision ? escapeRowAvx2Double : escapeRowAvx2Float;
+#endif
+    return doublePrecision ? escapeRowScalar<double> : escapeRowScalar<float>;
+}
+
+// Work-stealing pool for the tiles of a frame. Each thread owns a deque
+// seeded with a contiguous run of tiles; it pops from the back of its own and
+// steals from the front of the others' when that runs dry. Tiles inside the
+// set cost maxIter per pixel and tiles outside a handful, so an even static
+// split leaves most threads idle while one finishes the interior.
+struct TileQueue {
+    std::mutex mutex;
+    std::deque<int> tiles;
+};
+
+struct TilePool {
+    std::vector<std::thread> workers;
+    std::vector<TileQueue> queues; // one per worker, the last for the calling thread
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::function<void(int)> job;
+    unsigned busy; // workers still inside the current job
+    unsigned long generation;
+    bool done;
+    std::atomic<long> steals;
+};
+
+bool popTile(TilePool &pool, size_t self, int &tile) {
+    {
+        TileQueue &own = pool.queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tiles.empty()) {
+            tile = own.tiles.back();
+            own.tiles.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < pool.queues.size(); k++) {
+        TileQueue &victim = pool.queues[(self + k) % pool.queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tiles.empty()) {
+            tile = victim.tiles.front();
+            victim.tiles.pop_front();
+            pool.steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void runTiles(TilePool &pool, size_t self) {
+    int tile;
+    while (popTile(pool, self, tile)) pool.job(tile);
+}
+
+void tileWorkerLoop(TilePool* pool, size_t self) {
+    unsigned long seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            while (pool->generation == seen && !pool->done) pool->wake.wait(lock);
+            if (pool->done) return;
+            seen = pool->generation;
+        }
+        runTiles(*pool, self);
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->busy == 0) pool->idle.notify_one();
+    }
+}
+
+void startTilePool(TilePool &pool, int threads) {
+    pool.queues = std::vector<TileQueue>(threads + 1);
+    pool.busy = 0;
+    pool.generation = 0;
+    pool.done = false;
+    pool.steals = 0;
+    for (int i = 0; i < threads; i++) pool.workers.push_back(std::thread(tileWorkerLoop, &pool, (size_t) i));
+}
+
+// Runs job(tile) for every tile in [0, count) and returns when all are done.
+void forEachTile(TilePool &pool, int count, const std::function<void(int)> &job) {
+    size_t queues = pool.queues.size();
+    // the workers are all parked, so the queues can be filled without their locks
+    for (int t = 0; t < count; t++) pool.queues[(size_t) t * queues / count].tiles.push_back(t);
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.job = job;
+        pool.busy = (unsigned) pool.workers.size();
+        pool.generation++;
+        pool.wake.notify_all();
+    }
+    runTiles(pool, queues - 1);
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    while (pool.busy) pool.idle.wait(lock);
+}
+
+void stopTilePool(TilePool &pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.done = true;
+        pool.wake.notify_all();
+    }
+    for (size_t i = 0; i < pool.workers.size(); i++) pool.workers[i].join();
+}
+
+// Distance estimation: alongside z, dz/dc = 2 z dz/dc + 1, and once |z| is
+// large the distance from c to the set is close to |z| ln |z| / |dz/dc|.
+// The box test stops too early for that to hold, so these rows iterate to
+// |z| > 32. Points that never escape get 0, like the shader's black.
+template <typename T>
+void distanceRowScalar(const CpuView &view, int row, int x0, int x1, float* distances) {
+    T y = (T) pixelY(view, row);
+    for (int px = x0; px < x1; px++) {
+        T x = (T) pixelX(view, px);
+        distances[px] = 0.0f;
+        if (view.skipInterior && insideMainBulbs(x, y)) continue;
+        T r = 0, i = 0;
+        T dr = 0, di = 0;
+        T savedR = 0, savedI = 0;
+        int saveAt = 1;
+        for (int j = 0; j < view.maxIter; j++) {
+            T newdr = 2 * (r * dr - i * di) + 1;
+            di = 2 * (r * di + i * dr);
+            dr = newdr;
+            T newx = r * r - i * i + x;
+            T newy = 2 * r * i + y;
+            r = newx;
+            i = newy;
+            if (view.skipInterior) {
+                if (nearSaved(r, i, savedR, savedI)) break;
+                if (j == saveAt) {
+                    savedR = r;
+                    savedI = i;
+                    saveAt *= 2;
+                }
+            }
+            T m = r * r + i * i;
+            if (m > 1024) {
+                distances[px] = (float) (0.5 * log(m) * sqrt(m) / sqrt(dr * dr + di * di));
+                break;
+            }
+        }
+    }
+}
+
+typedef void (*DistanceRowFn)(const CpuView &view, int row, int x0, int x1, float* distances);
+
+// The shader's distance colouring: black on the set, white from four pixels
+// out, with a square root to widen the dark band around filaments.
+void shadeDistance(const std::vector<float> &distances, double pixelSize, std::vector<unsigned char> &gray) {
+    gray.resize(distances.size());
+    for (size_t p = 0; p < distances.size(); p++) {
+        float value = sqrtf(std::min(std::max(distances[p] / (4.0f * (float) pixelSize), 0.0f), 1.0f));
+        gray[p] = (unsigned char) rintf(value * 255.0f);
+    }
+}
+
+// Fills counts (width * height, top row first) tile by tile.
+void renderCpu(TilePool &pool, const CpuView &view, EscapeRowFn escapeRow, int tileSize, std::vector<int> &counts) {
+    counts.resize((size_t) view.width * view.height);
+    int tilesX = (view.width + tileSize - 1) / tileSize;
+    int tilesY = (view.height + tileSize - 1) / tileSize;
+    int* out = &counts[0];
+    forEachTile(pool, tilesX * tilesY, [&](int tile) {
+        int x0 = tile % tilesX * tileSize;
+        int y0 = tile / tilesX * tileSize;
+        int x1 = std::min(x0 + tileSize, view.width);
+        int y1 = std::min(y0 + tileSize, view.height);
+        for (int row = y0; row < y1; row++) escapeRow(view, row, x0, x1, out + (size_t) row * view.width);
+    });
+}
+
+void renderDistance(TilePool &pool, const CpuView &view, DistanceRowFn distanceRow, int tileSize, std::vector<float> &distances) {
+    distances.resize((size_t) view.width * view.height);
+    int tilesX = (view.width + tileSize - 1) / tileSize;
+    int tilesY = (view.height + tileSize - 1) / tileSize;
+    float* out = &distances[0];
+    forEachTile(pool, tilesX * tilesY, [&](int tile) {
+        int x0 = tile % tilesX * tileSize;
+        int y0 = tile / tilesX * tileSize;
+        int x1 = std::min(x0 + tileSize, view.width);
+        int y1 = std::min(y0 + tileSize, view.height);
+        for (int row = y0; row < y1; row++) distanceRow(view, row, x0, x1, out + (size_t) row * view.width);
+    });
+}
+
+// Fixed views for --interior-bench, from all exterior to mostly interior.
+struct BenchViewport {
+    const char* name;
+    double centerX, centerY;
+    double scale;
+    int maxIter;
+};
+
+const BenchViewport benchViewports[] = {
+    { "whole set", -0.5, 0.0, 1.5, 1000 },
+    { "main cardioid", -0.1, 0.0, 0.6, 5000 },
+    { "period-2 bulb", -1.0, 0.0, 0.3, 5000 },
+    { "period-3 minibrot", -1.7549, 0.0, 0.03, 5000 },
+    { "seahorse valley", -0.745, 0.11, 0.01, 2000 },
+    { "exterior", 0.6, 0.8, 0.1, 1000 },
+};
+
+// Share of a view's pixels the interior checks may change before the
+// benchmark flags it. Changed pixels are either on the edge of the cardioid
+// or bulb, where rounding lets the plain iteration escape from inside, or
+// slow exterior orbits the periodicity tolerance stops early. At 640x480
+// float changes at most a few pixels per view and double none.
+const double interiorDifferBound = 1e-4;
+
+// Times each view with and without the interior checks and counts the
+// pixels that change, marking views past interiorDifferBound.
+void runInteriorBenchmark(TilePool &pool, EscapeRowFn escapeRow, int tileSize, const char* label) {
+    double plainTotal = 0.0, skipTotal = 0.0;
+    for (size_t v = 0; v < sizeof(benchViewports) / sizeof(benchViewports[0]); v++) {
+        const BenchViewport &viewport = benchViewports[v];
+        CpuView view = { 640, 480, viewport.maxIter, viewport.centerX, viewport.centerY, viewport.scale, false };
+        std::vector<int> plain, skipped;
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        renderCpu(pool, view, escapeRow, tileSize, plain);
+        double plainMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        view.skipInterior = true;
+        start = std::chrono::high_resolution_clock::now();
+        renderCpu(pool, view, escapeRow, tileSize, skipped);
+        double skipMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        int differ = 0;
+        for (size_t p = 0; p < plain.size(); p++) differ += plain[p] != skipped[p];
+        int bound = (int) (interiorDifferBound * plain.size());
+        printf("%-18s %5d iterations: %9.2f ms plain, %8.2f ms with interior checks, %6.1fx, %d pixels differ (bound %d)%s\n",
+            viewport.name, viewport.maxIter, plainMs, skipMs, plainMs / skipMs, differ, bound, differ > bound ? ", over" : "");
+        plainTotal += plainMs;
+        skipTotal += skipMs;
+    }
+    printf("%s total: %.2f ms plain, %.2f ms with interior checks, %.1fx\n", label, plainTotal, skipTotal, plainTotal / skipTotal);
+}
+
+// The shader's colouring, 1 - j / 40 gray for escaped points and black
+// inside. GL leaves ties when storing a unorm colour to the driver; Mesa
+// rounds them to even, and so does rintf.
+void shadeGray(const std::vector<int> &counts, int maxIter, std::vector<unsigned char> &gray) {
+    gray.resize(counts.size());
+    for (size_t p = 0; p < counts.size(); p++) {
+        float value = counts[p] >= maxIter ? 0.0f : 1.0f - counts[p] / 40.0f;
+        gray[p] = (unsigned char) rintf(std::min(std::max(value, 0.0f), 1.0f) * 255.0f);
+    }
+}
+
+bool writePgm(const char* path, int width, int height, const std::vector<unsigned char> &gray) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
+    fprintf(file, "P5\n%d %d\n255\n", width, height);
+    fwrite(&gray[0], 1, gray.size(), file);
+    fclose(file);
+    return true;
+}
+
+// Fixed-point real for the deep zoom reference orbit. Sign and magnitude
+// over 32-bit limbs, least significant first; the last limb is the integer
+// part and the rest the fraction. Every operand of an operation has the same
+// limb count, chosen from the zoom depth.
+struct BigFixed {
+    bool negative;
+    std::vector<uint32_t> limbs;
+};
+
+BigFixed bigZero(int limbs) {
+    BigFixed zero;
+    zero.negative = false;
+    zero.limbs.assign(limbs, 0);
+    return zero;
+}
+
+int compareMagnitude(const BigFixed &a, const BigFixed &b) {
+    for (size_t i = a.limbs.size(); i-- > 0;) {
+        if (a.limbs[i] != b.limbs[i]) return a.limbs[i] < b.limbs[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+BigFixed bigAdd(const BigFixed &a, const BigFixed &b) {
+    BigFixed sum = bigZero((int) a.limbs.size());
+    if (a.negative == b.negative) {
+        uint64_t carry = 0;
+        for (size_t i = 0; i < a.limbs.size(); i++) {
+            carry += (uint64_t) a.limbs[i] + b.limbs[i];
+            sum.limbs[i] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        sum.negative = a.negative;
+        return sum;
+    }
+    // opposite signs: subtract the smaller magnitude from the larger
+    bool aLarger = compareMagnitude(a, b) >= 0;
+    const BigFixed &big = aLarger ? a : b;
+    const BigFixed &small = aLarger ? b : a;
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.limbs.size(); i++) {
+        int64_t diff = (int64_t) big.limbs[i] - small.limbs[i] - borrow;
+        borrow = diff < 0;
+        sum.limbs[i] = (uint32_t) (diff + (borrow << 32));
+    }
+    sum.negative = big.negative;
+    return sum;
+}
+
+BigFixed bigNegate(BigFixed a) {
+    a.negative = !a.negative;
+    return a;
+}
+
+BigFixed bigSub(const BigFixed &a, const BigFixed &b) {
+    return bigAdd(a, bigNegate(b));
+}
+
+// Truncating multiply. The integer limb must not overflow, which holds for
+// orbit values that have not escaped yet.
+BigFixed bigMul(const BigFixed &a, const BigFixed &b) {
+    size_t n = a.limbs.size();
+    std::vector<uint32_t> product(2 * n, 0);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < n; j++) {
+            carry += (uint64_t) a.limbs[i] * b.limbs[j] + product[i + j];
+            product[i + j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        product[i + n] = (uint32_t) carry;
+    }
+    BigFixed result;
+    result.negative = a.negative != b.negative;
+    result.limbs.assign(product.begin() + (n - 1), product.begin() + (2 * n - 1));
+    return result;
+}
+
+// Parses [-]digits[.digits], keeping every digit the limbs can hold.
+BigFixed bigFromString(const char* text, int limbs) {
+    BigFixed value = bigZero(limbs);
+    const char* p = text;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') p++;
+    uint32_t integer = 0;
+    for (; *p >= '0' && *p <= '9'; p++) integer = integer * 10 + (*p - '0');
+    if (*p == '.') {
+        const char* first = ++p;
+        while (*p >= '0' && *p <= '9') p++;
+        // fold the fraction in from its last digit: x = (x + d) / 10
+        for (const char* d = p; d-- > first;) {
+            value.limbs[limbs - 1] = *d - '0';
+            uint64_t remainder = 0;
+            for (int i = limbs; i-- > 0;) {
+                uint64_t current = (remainder << 32) | value.limbs[i];
+                value.limbs[i] = (uint32_t) (current / 10);
+                remainder = current % 10;
+            }
+        }
+    }
+    value.limbs[limbs - 1] = integer;
+    value.negative = negative;
+    return value;
+}
+
+double bigToDouble(const BigFixed &a) {
+    double value = 0.0;
+    size_t n = a.limbs.size();
+    // three limbs carry more bits than a double keeps
+    for (size_t i = n - std::min<size_t>(n, 4); i < n; i++) value += ldexp((double) a.limbs[i], 32 * ((int) i - (int) n + 1));
+    return a.negative ? -value : value;
+}
+
+// Deep zoom by perturbation. One reference orbit Z_n at the view centre is
+// iterated in BigFixed; every pixel c = C + dc then only tracks its offset
+// dz_n = z_n - Z_n in double:
+//     dz_{n+1} = 2 Z_n dz_n + dz_n^2 + dc
+// which stays accurate however small dc gets, down to the double exponent
+// range (about 1e-300). When |Z_m + dz| drops below |dz| the offset has
+// lost its precision relative to the orbit (a glitch), and when the
+// reference escapes there is no Z left to follow; either way the pixel is
+// rebased: dz becomes the full z and it continues from Z_0. The first
+// `skip` iterations are not run at all: a cubic series in dc,
+//     dz_n = A_n dc + B_n dc^2 + C_n dc^3,
+// is iterated with the orbit and evaluated directly at the last step where
+// it still agrees with probe pixels at the view's edge. Deep escape tests
+// use |z|^2 > 4 rather than the shader's box.
+struct ReferenceOrbit {
+    std::vector<double> re, im; // Z_0 up to the last iteration kept
+    int skip;
+    std::complex<double> a, b, c; // series coefficients at skip
+    int bits;
+};
+
+// Relative error of the series against the probes beyond which it stops.
+const double seriesTolerance = 1e-12;
+
+void computeReferenceOrbit(const char* centerRe, const char* centerIm, const CpuView &view, ReferenceOrbit &orbit) {
+    // enough fraction bits to resolve a pixel plus a margin against the
+    // rounding the orbit accumulates
+    int fractionBits = (int) ceil(-log2(view.scale / std::max(view.width, view.height))) + 64;
+    int limbs = 1 + std::max(2, (fractionBits + 31) / 32);
+    orbit.bits = 32 * limbs;
+    BigFixed cr = bigFromString(centerRe, limbs);
+    BigFixed ci = bigFromString(centerIm, limbs);
+    BigFixed zr = bigZero(limbs);
+    BigFixed zi = bigZero(limbs);
+    orbit.re.assign(1, 0.0);
+    orbit.im.assign(1, 0.0);
+    for (int n = 0; n < view.maxIter; n++) {
+        BigFixed zr2 = bigMul(zr, zr);
+        BigFixed zi2 = bigMul(zi, zi);
+        BigFixed zri = bigMul(zr, zi);
+        zi = bigAdd(bigAdd(zri, zri), ci);
+        zr = bigAdd(bigSub(zr2, zi2), cr);
+        double re = bigToDouble(zr), im = bigToDouble(zi);
+        orbit.re.push_back(re);
+        orbit.im.push_back(im);
+        if (re * re + im * im > 4.0) break;
+    }
+
+    // probes on the view's edge, where dc and so the series error is largest
+    std::vector<std::complex<double> > probeDc, probeDz;
+    for (int k = 0; k < 8; k++) {
+        double px = k < 3 ? -1.0 : k < 5 ? 0.0 : 1.0;
+        double py = k == 0 || k == 5 ? -1.0 : k == 1 || k == 3 || k == 6 ? 0.0 : 1.0;
+        probeDc.push_back(std::complex<double>(view.scale * px, view.scale * py));
+        probeDz.push_back(0.0);
+    }
+    std::complex<double> a = 0.0, b = 0.0, c = 0.0;
+    orbit.skip = 0;
+    orbit.a = orbit.b = orbit.c = 0.0;
+    int last = (int) orbit.re.size() - 1;
+    for (int n = 0; n + 1 < last; n++) {
+        std::complex<double> z(orbit.re[n], orbit.im[n]);
+        c = 2.0 * z * c + 2.0 * a * b;
+        b = 2.0 * z * b + a * a;
+        a = 2.0 * z * a + 1.0;
+        bool valid = true;
+        for (size_t k = 0; k < probeDc.size() && valid; k++) {
+            std::complex<double> dc = probeDc[k];
+            probeDz[k] = 2.0 * z * probeDz[k] + probeDz[k] * probeDz[k] + dc;
+            std::complex<double> series = ((c * dc + b) * dc + a) * dc;
+            std::complex<double> full = std::complex<double>(orbit.re[n + 1], orbit.im[n + 1]) + probeDz[k];
+            // a probe needing a rebase ends the series too
+            valid = std::abs(series - probeDz[k]) <= seriesTolerance * std::abs(probeDz[k]) &&
+                std::norm(full) >= std::norm(probeDz[k]) && std::norm(full) <= 4.0;
+        }
+        if (!valid) break;
+        orbit.skip = n + 1;
+        orbit.a = a;
+        orbit.b = b;
+        orbit.c = c;
+    }
+}
+
+std::complex<double> seriesStart(const ReferenceOrbit &orbit, std::complex<double> dc) {
+    return ((orbit.c * dc + orbit.b) * dc + orbit.a) * dc;
+}
+
+// Escape count of one pixel; adds its rebases to `rebases`.
+int perturbPixel(const ReferenceOrbit &orbit, int maxIter, double dcr, double dci, long &rebases) {
+    std::complex<double> dz = seriesStart(orbit, std::complex<double>(dcr, dci));
+    double dzr = dz.real(), dzi = dz.imag();
+    int last = (int) orbit.re.size() - 1;
+    int m = orbit.skip;
+    for (int n = orbit.skip; n < maxIter; n++) {
+        double zr = orbit.re[m], zi = orbit.im[m];
+        double newr = 2.0 * (zr * dzr - zi * dzi) + dzr * dzr - dzi * dzi + dcr;
+        double newi = 2.0 * (zr * dzi + zi * dzr) + 2.0 * dzr * dzi + dci;
+        dzr = newr;
+        dzi = newi;
+        m++;
+        zr = orbit.re[m] + dzr;
+        zi = orbit.im[m] + dzi;
+        double magnitude = zr * zr + zi * zi;
+        if (magnitude > 4.0) return n;
+        if (magnitude < dzr * dzr + dzi * dzi || m == last) {
+            dzr = zr;
+            dzi = zi;
+            m = 0;
+            rebases++;
+        }
+    }
+    return maxIter;
+}
+
+typedef void (*PerturbRowFn)(const ReferenceOrbit &orbit, const CpuView &view, int row, int x0, int x1, int* counts,
+    long &rebases);
+
+// dc relative to the view centre, in double from the start.
+double pixelDcX(const CpuView &view, int x) {
+    return view.scale * (2.0 * (x + 0.5) / view.width - 1.0);
+}
+
+double pixelDcY(const CpuView &view, int row) {
+    return view.scale * (1.0 - 2.0 * (row + 0.5) / view.height);
+}
+
+void perturbRowScalar(const ReferenceOrbit &orbit, const CpuView &view, int row, int x0, int x1, int* counts,
+    long &rebases) {
+    double dci = pixelDcY(view, row);
+    for (int px = x0; px < x1; px++) counts[px] = perturbPixel(orbit, view.maxIter, pixelDcX(view, px), dci, rebases);
+}
+
+#ifdef X86_SIMD
+// Four pixels of perturbPixel at once. Pixels rebase independently, so each
+// lane has its own orbit index and reads Z through gathers. Rebases are rare
+// next to iterations and are patched lane by lane.
+__attribute__((target("avx2")))
+void perturbRowAvx2(const ReferenceOrbit &orbit, const CpuView &view, int row, int x0, int x1, int* counts,
+    long &rebases) {
+    const double* orbitRe = &orbit.re[0];
+    const double* orbitIm = &orbit.im[0];
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i last = _mm_set1_epi32((int) orbit.re.size() - 1);
+    const __m256d dci = _mm256_set1_pd(pixelDcY(view, row));
+    for (int px = x0; px < x1; px += 4) {
+        double dcs[4], starts[8];
+        for (int l = 0; l < 4; l++) {
+            dcs[l] = pixelDcX(view, px + l);
+            std::complex<double> dz = seriesStart(orbit, std::complex<double>(dcs[l], pixelDcY(view, row)));
+            starts[l] = dz.real();
+            starts[4 + l] = dz.imag();
+        }
+        int lanes = std::min(4, x1 - px);
+        int active = (1 << lanes) - 1;
+        for (int l = 0; l < lanes; l++) counts[px + l] = view.maxIter;
+        __m256d dcr = _mm256_loadu_pd(dcs);
+        __m256d dzr = _mm256_loadu_pd(starts);
+        __m256d dzi = _mm256_loadu_pd(starts + 4);
+        __m128i m = _mm_set1_epi32(orbit.skip);
+        for (int n = orbit.skip; n < view.maxIter; n++) {
+            __m256d zr = _mm256_i32gather_pd(orbitRe, m, 8);
+            __m256d zi = _mm256_i32gather_pd(orbitIm, m, 8);
+            // same association as perturbPixel, so both give the same counts
+            __m256d newr = _mm256_mul_pd(two, _mm256_sub_pd(_mm256_mul_pd(zr, dzr), _mm256_mul_pd(zi, dzi)));
+            newr = _mm256_add_pd(_mm256_sub_pd(_mm256_add_pd(newr, _mm256_mul_pd(dzr, dzr)), _mm256_mul_pd(dzi, dzi)), dcr);
+            __m256d newi = _mm256_mul_pd(two, _mm256_add_pd(_mm256_mul_pd(zr, dzi), _mm256_mul_pd(zi, dzr)));
+            newi = _mm256_add_pd(_mm256_add_pd(newi, _mm256_mul_pd(_mm256_mul_pd(two, dzr), dzi)), dci);
+            dzr = newr;
+            dzi = newi;
+            m = _mm_add_epi32(m, one);
+            zr = _mm256_add_pd(_mm256_i32gather_pd(orbitRe, m, 8), dzr);
+            zi = _mm256_add_pd(_mm256_i32gather_pd(orbitIm, m, 8), dzi);
+            __m256d magnitude = _mm256_add_pd(_mm256_mul_pd(zr, zr), _mm256_mul_pd(zi, zi));
+            int escaped = _mm256_movemask_pd(_mm256_cmp_pd(magnitude, four, _CMP_GT_OQ)) & active;
+            if (escaped) {
+                for (int l = 0; l < 4; l++) {
+                    if (escaped & (1 << l)) counts[px + l] = n;
+                }
+                active &= ~escaped;
+                if (!active) break;
+            }
+            // every lane rebases at the end of the orbit, escaped or not, so
+            // no gather ever reads past it
+            __m256d dzMagnitude = _mm256_add_pd(_mm256_mul_pd(dzr, dzr), _mm256_mul_pd(dzi, dzi));
+            int rebase = _mm256_movemask_pd(_mm256_cmp_pd(magnitude, dzMagnitude, _CMP_LT_OQ))
+                | _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(m, last)));
+            if (!rebase) continue;
+            double r[4], i[4], zrs[4], zis[4];
+            int ms[4];
+            _mm256_storeu_pd(r, dzr);
+            _mm256_storeu_pd(i, dzi);
+            _mm256_storeu_pd(zrs, zr);
+            _mm256_storeu_pd(zis, zi);
+            _mm_storeu_si128((__m128i*) ms, m);
+            for (int l = 0; l < 4; l++) {
+                if (!(rebase & (1 << l))) continue;
+                r[l] = zrs[l];
+                i[l] = zis[l];
+                ms[l] = 0;
+                if (active & (1 << l)) rebases++;
+            }
+            dzr = _mm256_loadu_pd(r);
+            dzi = _mm256_loadu_pd(i);
+            m = _mm_loadu_si128((const __m128i*) ms);
+        }
+    }
+}
+#endif
+
+PerturbRowFn perturbRowFunction(CpuKernel kernel) {
+#ifdef X86_SIMD
+    if (kernel != KERNEL_SCALAR) return perturbRowAvx2;
+#endif
+    return perturbRowScalar;
+}
+
+// Renders the view around the BigFixed centre into counts. Rows are split
+// into tiles on the pool like renderCpu; the reference orbit is shared.
+void renderDeep(TilePool &pool, const CpuView &view, const ReferenceOrbit &orbit, PerturbRowFn perturbRow, int tileSize,
+    std::vector<int> &counts, long &rebases) {
+    counts.resize((size_t) view.width * view.height);
+    int tilesX = (view.width + tileSize - 1) / tileSize;
+    int tilesY = (view.height + tileSize - 1) / tileSize;
+    int* out = &counts[0];
+    std::atomic<long> total(0);
+    forEachTile(pool, tilesX * tilesY, [&](int tile) {
+        int x0 = tile % tilesX * tileSize;
+        int y0 = tile / tilesX * tileSize;
+        int x1 = std::min(x0 + tileSize, view.width);
+        int y1 = std::min(y0 + tileSize, view.height);
+        long tileRebases = 0;
+        for (int row = y0; row < y1; row++) perturbRow(orbit, view, row, x0, x1, out + (size_t) row * view.width, tileRebases);
+        total += tileRebases;
+    });
+    rebases = total;
+}
+
+// Stretches the view's escape counts over the gray ramp, light at the
+// lowest count. Deep views start thousands of iterations in, where the
+// shader's fixed 1 - j / 40 would be black throughout.
+void shadeRange(const std::vector<int> &counts, int maxIter, std::vector<unsigned char> &gray) {
+    int low = maxIter, high = 0;
+    for (size_t p = 0; p < counts.size(); p++) {
+        if (counts[p] >= maxIter) continue;
+        low = std::min(low, counts[p]);
+        high = std::max(high, counts[p]);
+    }
+    float range = (float) std::max(1, high - low);
+    gray.resize(counts.size());
+    for (size_t p = 0; p < counts.size(); p++) {
+        float value = counts[p] >= maxIter ? 0.0f : 1.0f - (counts[p] - low) / range;
+        gray[p] = (unsigned char) rintf(value * 255.0f);
+    }
+}
+
+// Map-style tiles. Level L splits the square [-2, 2] x [-2, 2] into 2^L by
+// 2^L tiles of pyramidTile pixels, x from the left and y from the top. Pixels
+// sample the corners of their cells rather than the centres, so every sample
+// is a dyadic rational double holds exactly and a tile's pixels are the even
+// pixels of its four children: a parent never needs iterating once its
+// children exist.
+const int pyramidTile = 256;
+// past this, tile indices overflow an int and double runs short of bits
+const int pyramidMaxLevel = 30;
+
+struct TileKey {
+    int level, x, y;
+    int maxIter;
+};
+
+bool operator<(const TileKey &a, const TileKey &b) {
+    if (a.level != b.level) return a.level < b.level;
+    if (a.x != b.x) return a.x < b.x;
+    if (a.y != b.y) return a.y < b.y;
+    return a.maxIter < b.maxIter;
+}
+
+CpuView tileView(const TileKey &key) {
+    double span = ldexp(4.0, -key.level);
+    CpuView view;
+    view.width = pyramidTile;
+    view.height = pyramidTile;
+    view.maxIter = key.maxIter;
+    view.scale = span / 2;
+    view.skipInterior = true;
+    // shifted half a pixel so pixelX(view, 0) is the tile's left edge exactly
+    view.centerX = -2.0 + key.x * span + view.scale - view.scale / pyramidTile;
+    view.centerY = 2.0 - key.y * span - view.scale + view.scale / pyramidTile;
+    return view;
+}
+
+// On-disk tile store, one file mapped whole. A header, then an open
+// addressing table of twice the tile capacity, then the tiles' escape counts
+// in the order they were stored. The file is created sparse at full size, so
+// only stored tiles take disk space, and it is reopened as is by later runs.
+// A store whose header doesn't match its size or this build's tile size, or
+// whose table doesn't match its header, is started afresh; a file without
+// the magic is left alone.
+struct StoreHeader {
+    char magic[8];
+    uint32_t tileSize;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t tableSize;
+};
+
+struct StoreEntry {
+    int32_t level, x, y, maxIter;
+    uint32_t slot; // 0 for an empty entry, else the tile's slot plus one
+};
+
+const char storeMagic[8] = { 'M', 'T', 'I', 'L', 'E', 'S', '1', 0 };
+
+struct TileStore {
+    int fd;
+    size_t bytes;
+    char* base;
+    StoreHeader* header;
+    StoreEntry* table;
+    int32_t* tiles;
+};
+
+size_t storeTilesOffset(uint32_t tableSize) {
+    size_t offset = sizeof(StoreHeader) + tableSize * sizeof(StoreEntry);
+    return (offset + 4095) & ~(size_t) 4095;
+}
+
+size_t storeBytes(uint32_t tableSize, uint32_t capacity) {
+    return storeTilesOffset(tableSize) + (size_t) capacity * pyramidTile * pyramidTile * sizeof(int32_t);
+}
+
+// Whether exactly header.count entries are in use, each pointing at a stored
+// tile. That also leaves empty entries for findStoreEntry's probes to stop at.
+bool storeTableValid(int fd, const StoreHeader &header) {
+    std::vector<StoreEntry> table(header.tableSize);
+    size_t bytes = table.size() * sizeof(StoreEntry);
+    if (pread(fd, &table[0], bytes, sizeof(StoreHeader)) != (ssize_t) bytes) return false;
+    uint32_t used = 0;
+    for (size_t e = 0; e < table.size(); e++) {
+        if (table[e].slot == 0) continue;
+        if (table[e].slot > header.count) return false;
+        used++;
+    }
+    return used == header.count;
+}
+
+bool openTileStore(TileStore &store, const char* path, int capacity) {
+    store.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (store.fd < 0) {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
+    struct stat info;
+    fstat(store.fd, &info);
+    StoreHeader header;
+    bool fresh = info.st_size == 0;
+    if (!fresh) {
+        if (pread(store.fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, storeMagic, 8) != 0) {
+            printf("%s is not a tile store.\n", path);
+            close(store.fd);
+            return false;
+        }
+        if (header.tileSize != (uint32_t) pyramidTile || header.capacity == 0 || header.tableSize != 2 * header.capacity ||
+            header.count > header.capacity || (size_t) info.st_size != storeBytes(header.tableSize, header.capacity) ||
+            !storeTableValid(store.fd, header)) {
+            printf("%s does not match its header, starting it afresh.\n", path);
+            fresh = true;
+        }
+        store.bytes = info.st_size;
+    }
+    if (fresh) {
+        memcpy(header.magic, storeMagic, 8);
+        header.tileSize = pyramidTile;
+        header.capacity = capacity;
+        header.count = 0;
+        header.tableSize = 2 * capacity;
+        store.bytes = storeBytes(header.tableSize, header.capacity);
+        // truncating first drops whatever a damaged store held
+        if (ftruncate(store.fd, 0) != 0 || ftruncate(store.fd, store.bytes) != 0) {
+            printf("Failed to size %s\n", path);
+            close(store.fd);
+            return false;
+        }
+    }
+    void* base = mmap(NULL, store.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, store.fd, 0);
+    if (base == MAP_FAILED) {
+        printf("Failed to map %s\n", path);
+        close(store.fd);
+        return false;
+    }
+    store.base = (char*) base;
+    store.header = (StoreHeader*) base;
+    if (fresh) *store.header = header;
+    store.table = (StoreEntry*) (store.base + sizeof(StoreHeader));
+    store.tiles = (int32_t*) (store.base + storeTilesOffset(store.header->tableSize));
+    return true;
+}
+
+void closeTileStore(TileStore &store) {
+    msync(store.base, store.bytes, MS_SYNC);
+    munmap(store.base, store.bytes);
+    close(store.fd);
+}
+
+// The key's entry, or the empty one where it would go.
+StoreEntry* findStoreEntry(TileStore &store, const TileKey &key) {
+    uint32_t hash = (uint32_t) key.level * 73856093u ^ (uint32_t) key.x * 19349663u ^ (uint32_t) key.y * 83492791u ^
+        (uint32_t) key.maxIter * 2654435761u;
+    uint32_t tableSize = store.header->tableSize;
+    for (uint32_t probe = hash % tableSize;; probe = (probe + 1) % tableSize) {
+        StoreEntry* entry = &store.table[probe];
+        if (entry->slot == 0) return entry;
+        if (entry->level == key.level && entry->x == key.x && entry->y == key.y && entry->maxIter == key.maxIter) return entry;
+    }
+}
+
+bool loadStoredTile(TileStore &store, const TileKey &key, std::vector<int> &counts) {
+    StoreEntry* entry = findStoreEntry(store, key);
+    if (entry->slot == 0) return false;
+    const int32_t* tile = store.tiles + (size_t) (entry->slot - 1) * pyramidTile * pyramidTile;
+    counts.assign(tile, tile + pyramidTile * pyramidTile);
+    return true;
+}
+
+bool saveStoredTile(TileStore &store, const TileKey &key, const std::vector<int> &counts) {
+    StoreEntry* entry = findStoreEntry(store, key);
+    if (entry->slot != 0) return true;
+    if (store.header->count >= store.header->capacity) return false;
+    uint32_t slot = store.header->count++;
+    memcpy(store.tiles + (size_t) slot * pyramidTile * pyramidTile, &counts[0], counts.size() * sizeof(int32_t));
+    entry->level = key.level;
+    entry->x = key.x;
+    entry->y = key.y;
+    entry->maxIter = key.maxIter;
+    entry->slot = slot + 1;
+    return true;
+}
+
+// Tiles by key: the most recently used in memory, every finished one in the
+// store when there is one. Shared by the pool's threads.
+struct TilePyramid {
+    TileStore store;
+    bool hasStore;
+    bool storeFull;
+    size_t memoryTiles;
+    std::list<TileKey> recent; // most recent first
+    std::map<TileKey, std::pair<std::vector<int>, std::list<TileKey>::iterator> > cached;
+    std::mutex mutex;
+    EscapeRowFn escapeRow;
+    std::atomic<long> memoryHits, storeHits, derived, rendered;
+};
+
+void initTilePyramid(TilePyramid &pyramid, EscapeRowFn escapeRow, size_t memoryTiles) {
+    pyramid.hasStore = false;
+    pyramid.storeFull = false;
+    pyramid.memoryTiles = std::max((size_t) 1, memoryTiles);
+    pyramid.escapeRow = escapeRow;
+    pyramid.memoryHits = 0;
+    pyramid.storeHits = 0;
+    pyramid.derived = 0;
+    pyramid.rendered = 0;
+}
+
+// Caller holds the mutex.
+void rememberTile(TilePyramid &pyramid, const TileKey &key, const std::vector<int> &counts) {
+    if (pyramid.cached.count(key)) return;
+    pyramid.recent.push_front(key);
+    pyramid.cached[key] = std::make_pair(counts, pyramid.recent.begin());
+    if (pyramid.cached.size() > pyramid.memoryTiles) {
+        pyramid.cached.erase(pyramid.recent.back());
+        pyramid.recent.pop_back();
+    }
+}
+
+// Finds a finished tile in memory or the store, without computing anything.
+bool lookupTile(TilePyramid &pyramid, const TileKey &key, std::vector<int> &counts) {
+    std::lock_guard<std::mutex> lock(pyramid.mutex);
+    std::map<TileKey, std::pair<std::vector<int>, std::list<TileKey>::iterator> >::iterator found = pyramid.cached.find(key);
+    if (found != pyramid.cached.end()) {
+        pyramid.recent.splice(pyramid.recent.begin(), pyramid.recent, found->second.second);
+        counts = found->second.first;
+        pyramid.memoryHits++;
+        return true;
+    }
+    if (pyramid.hasStore && loadStoredTile(pyramid.store, key, counts)) {
+        rememberTile(pyramid, key, counts);
+        pyramid.storeHits++;
+        return true;
+    }
+    return false;
+}
+
+void putTile(TilePyramid &pyramid, const TileKey &key, const std::vector<int> &counts) {
+    std::lock_guard<std::mutex> lock(pyramid.mutex);
+    rememberTile(pyramid, key, counts);
+    if (pyramid.hasStore && !saveStoredTile(pyramid.store, key, counts) && !pyramid.storeFull) {
+        printf("The tile store is full; further tiles are kept in memory only.\n");
+        pyramid.storeFull = true;
+    }
+}
+
+// Builds a tile from its four children if they are all finished.
+bool deriveTile(TilePyramid &pyramid, const TileKey &key, std::vector<int> &counts) {
+    if (key.level >= pyramidMaxLevel) return false;
+    std::vector<int> children[4];
+    for (int q = 0; q < 4; q++) {
+        TileKey child = { key.level + 1, 2 * key.x + (q & 1), 2 * key.y + (q >> 1), key.maxIter };
+        if (!lookupTile(pyramid, child, children[q])) return false;
+    }
+    const int half = pyramidTile / 2;
+    counts.resize(pyramidTile * pyramidTile);
+    for (int row = 0; row < pyramidTile; row++) {
+        for (int x = 0; x < pyramidTile; x++) {
+            const std::vector<int> &child = children[(row >= half) * 2 + (x >= half)];
+            counts[row * pyramidTile + x] = child[(2 * row % pyramidTile) * pyramidTile + 2 * x % pyramidTile];
+        }
+    }
+    pyramid.derived++;
+    return true;
+}
+
+void renderTile(TilePyramid &pyramid, const TileKey &key, std::vector<int> &counts) {
+    CpuView view = tileView(key);
+    counts.resize(pyramidTile * pyramidTile);
+    for (int row = 0; row < pyramidTile; row++) pyramid.escapeRow(view, row, 0, pyramidTile, &counts[row * pyramidTile]);
+    pyramid.rendered++;
+}
+
+// A tile from wherever is cheapest: memory, the store, its children, and
+// only then the kernel.
+void getTile(TilePyramid &pyramid, const TileKey &key, std::vector<int> &counts) {
+    if (lookupTile(pyramid, key, counts)) return;
+    if (!deriveTile(pyramid, key, counts)) renderTile(pyramid, key, counts);
+    putTile(pyramid, key, counts);
+}
+
+// Pre-renders every tile down to depth: the deepest level with the kernel,
+// a tile per pool job, and the levels above from their children.
+void buildPyramid(TilePool &pool, TilePyramid &pyramid, int depth, int maxIter) {
+    for (int level = depth; level >= 0; level--) {
+        int side = 1 << level;
+        forEachTile(pool, side * side, [&](int tile) {
+            TileKey key = { level, tile % side, tile / side, maxIter };
+            std::vector<int> counts;
+            getTile(pyramid, key, counts);
+        });
+    }
+}
+
+// Every program draws the fullscreen quad with position at location 0.
+GLuint linkProgram(GLuint vertexShader, GLuint fragmentShader) {
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    glBindAttribLocation(program, 0, "position");
+    glBindFragDataLocation(program, 0, "outColor");
+    glLinkProgram(program);
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        char buffer[512];
+        glGetProgramInfoLog(program, 512, NULL, buffer);
+        printf("Program failed to link:\n%s", buffer);
+    }
+    return program;
+}
+
+struct RenderTexture {
+    GLuint texture, fbo;
+    int width, height;
+};
+
+RenderTexture makeRenderTexture(int width, int height, GLenum format) {
+    RenderTexture target;
+    target.width = width;
+    target.height = height;
+    glGenTextures(1, &target.texture);
+    glBindTexture(GL_TEXTURE_2D, target.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glGenFramebuffers(1, &target.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("Framebuffer is incomplete.\n");
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    return target;
+}
+
+void deleteRenderTexture(RenderTexture &target) {
+    glDeleteFramebuffers(1, &target.fbo);
+    glDeleteTextures(1, &target.texture);
+}
+
+const int refineLevels = 4;
+
+// Progressive rendering of the interactive view. After the view changes,
+// the last frame is reprojected and four levels are drawn from 1/8
+// resolution and 1/64 of the iterations up to full resolution and
+// iterations, each in bands of rows sized so that a frame's bands fit its
+// time budget. The composite shows the finest data each pixel has.
+struct Refiner {
+    RenderTexture levels[refineLevels];
+    int iterations[refineLevels];
+    double msPerRow[refineLevels]; // last measured, 0 before the first band
+    RenderTexture display, reprojected;
+    int refining; // level being drawn
+    int row; // rows of it done
+    CpuView shown; // the view display holds
+    bool hasShown;
+};
+
+void makeRefiner(Refiner &refiner, const CpuView &view) {
+    for (int k = 0; k < refineLevels; k++) {
+        int shift = refineLevels - 1 - k;
+        refiner.levels[k] = makeRenderTexture(std::max(1, view.width >> shift), std::max(1, view.height >> shift), GL_R32F);
+        refiner.msPerRow[k] = 0.0;
+    }
+    refiner.display = makeRenderTexture(view.width, view.height, GL_RGBA8);
+    refiner.reprojected = makeRenderTexture(view.width, view.height, GL_RGBA8);
+    refiner.refining = 0;
+    refiner.row = 0;
+    refiner.shown = view;
+    refiner.hasShown = false;
+}
+
+void deleteRefiner(Refiner &refiner) {
+    for (int k = 0; k < refineLevels; k++) deleteRenderTexture(refiner.levels[k]);
+    deleteRenderTexture(refiner.display);
+    deleteRenderTexture(refiner.reprojected);
+}
+
+// Uniform locations of the three programs of the interactive view.
+struct ViewPrograms {
+    GLuint escape, reproject, composite;
+    GLint escapeCenter, escapeScale, escapeMaxIter, escapePixelSize, escapeColoring;
+    GLint reprojectCenter, reprojectScale, reprojectPreviousCenter, reprojectPreviousScale;
+    GLint compositeRefining, compositeRefinedRows, compositeColoring, compositeLogMax;
+};
+
+// Starts over for a new view, keeping what the last frame showed.
+void restartRefiner(Refiner &refiner, const ViewPrograms &programs, const CpuView &view) {
+    for (int k = 0; k < refineLevels; k++) {
+        int shift = refineLevels - 1 - k;
+        refiner.iterations[k] = std::max(std::min(view.maxIter, 32), view.maxIter >> (2 * shift));
+    }
+    refiner.refining = 0;
+    refiner.row = 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, refiner.reprojected.fbo);
+    if (!refiner.hasShown) {
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        return;
+    }
+    glViewport(0, 0, view.width, view.height);
+    glUseProgram(programs.reproject);
+    glUniform2f(programs.reprojectCenter, (float) view.centerX, (float) view.centerY);
+    glUniform1f(programs.reprojectScale, (float) view.scale);
+    glUniform2f(programs.reprojectPreviousCenter, (float) refiner.shown.centerX, (float) refiner.shown.centerY);
+    glUniform1f(programs.reprojectPreviousScale, (float) refiner.shown.scale);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D, refiner.display.texture);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+}
+
+// Draws bands of the current level until budgetMs is spent, at least one per
+// frame. Each band is finished with glFinish so its cost is known before the
+// next is sized; the stall is the price of bounding the frame time.
+void refine(Refiner &refiner, const ViewPrograms &programs, const CpuView &view, double budgetMs) {
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    glUseProgram(programs.escape);
+    glUniform2f(programs.escapeCenter, (float) view.centerX, (float) view.centerY);
+    glUniform1f(programs.escapeScale, (float) view.scale);
+    glEnable(GL_SCISSOR_TEST);
+    bool first = true;
+    while (refiner.refining < refineLevels) {
+        int k = refiner.refining;
+        RenderTexture &level = refiner.levels[k];
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        int rows = level.height - refiner.row;
+        // an unmeasured level starts with one row to learn its cost
+        if (refiner.msPerRow[k] <= 0.0) rows = 1;
+        else rows = std::min(rows, (int) ((budgetMs - elapsed) / refiner.msPerRow[k]));
+        if (rows < 1) {
+            if (!first) break;
+            rows = 1;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, level.fbo);
+        glViewport(0, 0, level.width, level.height);
+        glScissor(0, refiner.row, level.width, rows);
+        glUniform1i(programs.escapeMaxIter, refiner.iterations[k]);
+        glUniform1f(programs.escapePixelSize, (float) (2.0 * view.scale / level.height));
+        std::chrono::high_resolution_clock::time_point bandStart = std::chrono::high_resolution_clock::now();
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        glFinish();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - bandStart).count();
+        refiner.msPerRow[k] = ms / rows;
+        first = false;
+        refiner.row += rows;
+        if (refiner.row >= level.height) {
+            refiner.refining++;
+            refiner.row = 0;
+        }
+    }
+    glDisable(GL_SCISSOR_TEST);
+}
+
+// logMax is the bin scale of the histogram on unit 6, see equalize.
+void composite(Refiner &refiner, const ViewPrograms &programs, const CpuView &view, float logMax) {
+    glBindFramebuffer(GL_FRAMEBUFFER, refiner.display.fbo);
+    glViewport(0, 0, view.width, view.height);
+    glUseProgram(programs.composite);
+    glUniform1f(programs.compositeLogMax, logMax);
+    float rows = refiner.refining < refineLevels ? (float) refiner.row / refiner.levels[refiner.refining].height : 0.0f;
+    glUniform1i(programs.compositeRefining, refiner.refining);
+    glUniform1f(programs.compositeRefinedRows, rows);
+    for (int k = 0; k < refineLevels; k++) {
+        glActiveTexture(GL_TEXTURE0 + k);
+        glBindTexture(GL_TEXTURE_2D, refiner.levels[k].texture);
+    }
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_2D, refiner.reprojected.texture);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    refiner.shown = view;
+    refiner.hasShown = true;
+}
+
+// Changing the colouring changes what the levels hold, so the caller starts
+// the refinement over without reprojecting.
+void setColoring(const ViewPrograms &programs, Coloring coloring) {
+    glUseProgram(programs.escape);
+    glUniform1i(programs.escapeColoring, coloring);
+    glUseProgram(programs.composite);
+    glUniform1i(programs.compositeColoring, coloring);
+}
+
+// A cyclic blue, white and orange gradient, 256 entries, sampled with
+// wrapping so smooth colouring can run the count straight into it.
+GLuint makePalette() {
+    const float stops[][4] = {
+        { 0.0f, 0, 7, 100 },
+        { 0.16f, 32, 107, 203 },
+        { 0.42f, 237, 255, 255 },
+        { 0.6425f, 255, 170, 0 },
+        { 0.8575f, 0, 2, 0 },
+        { 1.0f, 0, 7, 100 },
+    };
+    unsigned char colors[256 * 3];
+    int stop = 0;
+    for (int e = 0; e < 256; e++) {
+        float t = e / 256.0f;
+        while (t > stops[stop + 1][0]) stop++;
+        float f = (t - stops[stop][0]) / (stops[stop + 1][0] - stops[stop][0]);
+        for (int c = 0; c < 3; c++) colors[e * 3 + c] = (unsigned char) (stops[stop][c + 1] + f * (stops[stop + 1][c + 1] - stops[stop][c + 1]));
+    }
+    GLuint palette;
+    glGenTextures(1, &palette);
+    glBindTexture(GL_TEXTURE_1D, palette);
+    glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB8, 256, 0, GL_RGB, GL_UNSIGNED_BYTE, colors);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    return palette;
+}
+
+const int histogramBins = 1024;
+
+// The histogram and prefix sum behind COLOR_EQUALIZED, with a timer query
+// around them where GL has one.
+struct Equalizer {
+    GLuint histogram, scan;
+    GLuint vao; // attributeless, the points read their pixel by gl_VertexID
+    GLint stride, scanOffset, histogramLogMax;
+    float logMax; // bin scale of the current histogram, for the composite
+    RenderTexture counts, sums[2];
+    bool timed, pending;
+    GLuint query;
+    double totalMs;
+    int frames;
+};
+
+void makeEqualizer(Equalizer &equalizer, GLuint histogram, GLuint scan) {
+    equalizer.histogram = histogram;
+    equalizer.scan = scan;
+    glUseProgram(histogram);
+    glUniform1i(glGetUniformLocation(histogram, "values"), 7);
+    equalizer.stride = glGetUniformLocation(histogram, "stride");
+    glUniform1i(glGetUniformLocation(histogram, "bins"), histogramBins);
+    equalizer.histogramLogMax = glGetUniformLocation(histogram, "logMax");
+    equalizer.logMax = 1.0f;
+    glUseProgram(scan);
+    glUniform1i(glGetUniformLocation(scan, "partial"), 7);
+    equalizer.scanOffset = glGetUniformLocation(scan, "offset");
+    glGenVertexArrays(1, &equalizer.vao);
+    equalizer.counts = makeRenderTexture(histogramBins, 1, GL_R32F);
+    equalizer.sums[0] = makeRenderTexture(histogramBins, 1, GL_R32F);
+    equalizer.sums[1] = makeRenderTexture(histogramBins, 1, GL_R32F);
+    equalizer.timed = GLEW_ARB_timer_query || GLEW_VERSION_3_3;
+    equalizer.pending = false;
+    if (equalizer.timed) glGenQueries(1, &equalizer.query);
+    equalizer.totalMs = 0.0;
+    equalizer.frames = 0;
+}
+
+void deleteEqualizer(Equalizer &equalizer) {
+    if (equalizer.timed) glDeleteQueries(1, &equalizer.query);
+    deleteRenderTexture(equalizer.counts);
+    deleteRenderTexture(equalizer.sums[0]);
+    deleteRenderTexture(equalizer.sums[1]);
+    glDeleteVertexArrays(1, &equalizer.vao);
+}
+
+// Builds the running totals over every stride-th pixel of source, drawn with
+// maxIter iterations, and leaves them on texture unit 6 for the composite.
+// Last frame's timing is collected first, by which point the GPU has long
+// finished it.
+void equalize(Equalizer &equalizer, const RenderTexture &source, int stride, int maxIter, GLuint quadVao) {
+    if (equalizer.pending) {
+        GLuint64 ns;
+        glGetQueryObjectui64v(equalizer.query, GL_QUERY_RESULT, &ns);
+        equalizer.totalMs += ns / 1e6;
+        equalizer.frames++;
+        equalizer.pending = false;
+    }
+    if (equalizer.timed) glBeginQuery(GL_TIME_ELAPSED, equalizer.query);
+    glBindFramebuffer(GL_FRAMEBUFFER, equalizer.counts.fbo);
+    glViewport(0, 0, histogramBins, 1);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glUseProgram(equalizer.histogram);
+    glUniform1i(equalizer.stride, stride);
+    equalizer.logMax = log2f(1.0f + maxIter);
+    glUniform1f(equalizer.histogramLogMax, equalizer.logMax);
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_2D, source.texture);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glBindVertexArray(equalizer.vao);
+    glDrawArrays(GL_POINTS, 0, (source.width / stride) * (source.height / stride));
+    glDisable(GL_BLEND);
+
+    glBindVertexArray(quadVao);
+    glUseProgram(equalizer.scan);
+    const RenderTexture* partial = &equalizer.counts;
+    int next = 0;
+    for (int offset = 1; offset < histogramBins; offset *= 2) {
+        glBindFramebuffer(GL_FRAMEBUFFER, equalizer.sums[next].fbo);
+        glBindTexture(GL_TEXTURE_2D, partial->texture);
+        glUniform1i(equalizer.scanOffset, offset);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        partial = &equalizer.sums[next];
+        next ^= 1;
+    }
+    if (equalizer.timed) {
+        glEndQuery(GL_TIME_ELAPSED);
+        equalizer.pending = true;
+    }
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_2D, partial->texture);
+}
+
+// Zooms by factor (below 1 magnifies) keeping the point under window pixel
+// (x, y) fixed.
+void zoomView(CpuView &view, double factor, int x, int y) {
+    double px = pixelX(view, x), py = pixelY(view, y);
+    view.centerX = px + (view.centerX - px) * factor;
+    view.centerY = py + (view.centerY - py) * factor;
+    view.scale *= factor;
+}
+
 int main(int argc, char *argv[]) {
+    const char* cpuOut = NULL;
+    CpuView view = { 800, 600, 30, 0.0, 0.0, 2.0, true };
+    const char* kernelName = NULL; // widest available
+    bool doublePrecision = false;
+    int threads = std::max(1, (int) std::thread::hardware_concurrency());
+    int tileSize = 32;
+    double budgetMs = 8.0;
+    bool deep = false;
+    bool distanceEstimate = false;
+    Coloring coloring = COLOR_EQUALIZED;
+    bool interiorBench = false;
+    const char* centerRe = "0";
+    const char* centerIm = "0";
+    const char* storePath = NULL;
+    int storeTiles = 4096;
+    int memoryTiles = 64;
+    int pyramidDepth = -1;
+    const char* tileOut = NULL;
+    TileKey tileKey = { 0, 0, 0, 0 };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) cpuOut = argv[++i];
+        else if (strcmp(argv[i], "--deep") == 0) deep = true;
+        else if (strcmp(argv[i], "--de") == 0) distanceEstimate = true;
+        else if (strcmp(argv[i], "--coloring") == 0 && i + 1 < argc) {
+            i++;
+            int c = COLOR_GRAY;
+            while (c <= COLOR_DISTANCE && strcmp(argv[i], coloringNames[c]) != 0) c++;
+            if (c > COLOR_DISTANCE) {
+                printf("Unknown colouring %s, expected gray, smooth, equalized or distance.\n", argv[i]);
+                return 1;
+            }
+            coloring = (Coloring) c;
+        }
+        else if (strcmp(argv[i], "--no-interior") == 0) view.skipInterior = false;
+        else if (strcmp(argv[i], "--interior-bench") == 0) interiorBench = true;
+        else if (strcmp(argv[i], "--center") == 0 && i + 2 < argc) {
+            centerRe = argv[++i];
+            centerIm = argv[++i];
+        }
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) view.scale = atof(argv[++i]);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            i++;
+            int w, h;
+            if (sscanf(argv[i], "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+                printf("--size expects WIDTHxHEIGHT, got %s.\n", argv[i]);
+                return 1;
+            }
+            view.width = w;
+            view.height = h;
+        }
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) view.maxIter = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) kernelName = argv[++i];
+        else if (strcmp(argv[i], "--double") == 0) doublePrecision = true;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) tileSize = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) budgetMs = atof(argv[++i]);
+        else if (strcmp(argv[i], "--tiles") == 0 && i + 1 < argc) storePath = argv[++i];
+        else if (strcmp(argv[i], "--store-tiles") == 0 && i + 1 < argc) storeTiles = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--cache-tiles") == 0 && i + 1 < argc) memoryTiles = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--pyramid") == 0 && i + 1 < argc) pyramidDepth = std::min(atoi(argv[++i]), pyramidMaxLevel);
+        else if (strcmp(argv[i], "--tile-pgm") == 0 && i + 4 < argc) {
+            tileKey.level = std::min(atoi(argv[++i]), pyramidMaxLevel);
+            tileKey.x = atoi(argv[++i]);
+            tileKey.y = atoi(argv[++i]);
+            tileOut = argv[++i];
+        }
+    }
+    if (tileOut) {
+        int tiles = tileKey.level >= 0 ? 1 << tileKey.level : 0;
+        if (tileKey.x < 0 || tileKey.x >= tiles || tileKey.y < 0 || tileKey.y >= tiles) {
+            printf("--tile-pgm: tile %d %d is outside level %d.\n", tileKey.x, tileKey.y, tileKey.level);
+            return 1;
+        }
+    }
+    if (pyramidDepth >= 0 && !storePath) printf("--pyramid without --tiles keeps tiles in memory only.\n");
+
+    view.centerX = atof(centerRe);
+    view.centerY = atof(centerIm);
+
+    CpuKernel kernel = detectKernel();
+    if (kernelName) {
+        CpuKernel wanted = KERNEL_SCALAR;
+        if (strcmp(kernelName, "avx2") == 0) wanted = KERNEL_AVX2;
+        else if (strcmp(kernelName, "avx512") == 0) wanted = KERNEL_AVX512;
+        if (wanted > kernel) printf("%s is not available here, using %s.\n", kernelName, kernelNames[kernel]);
+        else kernel = wanted;
+    }
+
+    if (interiorBench) {
+        TilePool pool;
+        startTilePool(pool, threads - 1);
+        char label[64];
+        snprintf(label, sizeof(label), "%s %s", kernelNames[kernel], doublePrecision ? "double" : "float");
+        printf("Interior checks, %s, %d threads, 640x480:\n", label, threads);
+        runInteriorBenchmark(pool, escapeRowFunction(kernel, doublePrecision), tileSize, label);
+        stopTilePool(pool);
+        return 0;
+    }
+
+    // --pyramid fills the tile store down to a depth on all cores, and
+    // --tile-pgm fetches one tile through it; tiles are always double, as
+    // float runs out of precision a dozen levels down
+    if (pyramidDepth >= 0 || tileOut) {
+        TilePyramid pyramid;
+        initTilePyramid(pyramid, escapeRowFunction(kernel, true), memoryTiles);
+        if (storePath) {
+            if (!openTileStore(pyramid.store, storePath, storeTiles)) return 1;
+            pyramid.hasStore = true;
+        }
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        std::vector<int> counts;
+        if (pyramidDepth >= 0) {
+            TilePool pool;
+            startTilePool(pool, threads - 1);
+            buildPyramid(pool, pyramid, pyramidDepth, view.maxIter);
+            stopTilePool(pool);
+        }
+        if (tileOut) {
+            tileKey.maxIter = view.maxIter;
+            getTile(pyramid, tileKey, counts);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        printf("Tiles %s: %ld rendered, %ld derived from children, %ld from memory, %ld from the store, %.2f ms\n",
+            kernelNames[kernel], (long) pyramid.rendered, (long) pyramid.derived, (long) pyramid.memoryHits,
+            (long) pyramid.storeHits, ms);
+        if (pyramid.hasStore) closeTileStore(pyramid.store);
+        if (!tileOut) return 0;
+        std::vector<unsigned char> gray;
+        shadeGray(counts, view.maxIter, gray);
+        return writePgm(tileOut, pyramidTile, pyramidTile, gray) ? 0 : 1;
+    }
+
+    // --cpu renders one frame to a PGM without touching GL, for machines
+    // without a GPU and as a reference for the shader
+    if (cpuOut) {
+        TilePool pool;
+        // the calling thread works too
+        startTilePool(pool, threads - 1);
+        std::vector<int> counts;
+        std::vector<unsigned char> gray;
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        // --deep perturbs around a BigFixed reference instead, for scales
+        // far below what float or double can resolve
+        if (deep) {
+            ReferenceOrbit orbit;
+            computeReferenceOrbit(centerRe, centerIm, view, orbit);
+            double orbitMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            long rebases = 0;
+            renderDeep(pool, view, orbit, perturbRowFunction(kernel), tileSize, counts, rebases);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            stopTilePool(pool);
+            printf("Deep %s: %dx%d at scale %g, %d iterations, %d-bit reference orbit of %zu steps (%.2f ms), "
+                "series skips %d, %ld rebases, %.2f ms\n", kernel == KERNEL_SCALAR ? "scalar" : "avx2", view.width, view.height,
+                view.scale, view.maxIter, orbit.bits, orbit.re.size() - 1, orbitMs, orbit.skip, rebases, ms);
+            shadeRange(counts, view.maxIter, gray);
+            return writePgm(cpuOut, view.width, view.height, gray) ? 0 : 1;
+        }
+        // --de shades by estimated distance to the set, scalar only
+        if (distanceEstimate) {
+            std::vector<float> distances;
+            renderDistance(pool, view, doublePrecision ? distanceRowScalar<double> : distanceRowScalar<float>, tileSize, distances);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            stopTilePool(pool);
+            printf("CPU distance estimate %s: %dx%d, %d iterations, %d threads, %.2f ms\n", doublePrecision ? "double" : "float",
+                view.width, view.height, view.maxIter, threads, ms);
+            shadeDistance(distances, 2.0 * view.scale / view.height, gray);
+            return writePgm(cpuOut, view.width, view.height, gray) ? 0 : 1;
+        }
+        renderCpu(pool, view, escapeRowFunction(kernel, doublePrecision), tileSize, counts);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        stopTilePool(pool);
+        printf("CPU %s %s: %dx%d, %d iterations, %d threads, %ld tiles stolen, %.2f ms\n", kernelNames[kernel],
+            doublePrecision ? "double" : "float", view.width, view.height, view.maxIter, threads, (long) pool.steals, ms);
+        shadeGray(counts, view.maxIter, gray);
+        return writePgm(cpuOut, view.width, view.height, gray) ? 0 : 1;
+    }
+
     SDL_Init(SDL_INIT_VIDEO);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
     SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
-    SDL_Window* window = SDL_CreateWindow("OpenGL", 100, 100, 800, 600, SDL_WINDOW_OPENGL);
+    SDL_Window* window = SDL_CreateWindow("OpenGL", 100, 100, view.width, view.height, SDL_WINDOW_OPENGL);
     SDL_GLContext context = SDL_GL_CreateContext(window);
     glewExperimental = GL_TRUE;
     glewInit();
@@ -100,38 +2098,144 @@ int main(int argc, char *argv[]) {
 
     GLuint vertexShader = makeShader(GL_VERTEX_SHADER, vertexSource);
     GLuint fragmentShader = makeShader(GL_FRAGMENT_SHADER, fragmentSource);
+    GLuint reprojectShader = makeShader(GL_FRAGMENT_SHADER, reprojectFSource);
+    GLuint compositeShader = makeShader(GL_FRAGMENT_SHADER, compositeFSource);
+    GLuint histogramVShader = makeShader(GL_VERTEX_SHADER, histogramVSource);
+    GLuint histogramFShader = makeShader(GL_FRAGMENT_SHADER, histogramFSource);
+    GLuint scanShader = makeShader(GL_FRAGMENT_SHADER, scanFSource);
 
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glBindFragDataLocation(shaderProgram, 0, "outColor");
-    glLinkProgram(shaderProgram);
-    glUseProgram(shaderProgram);
+    ViewPrograms programs;
+    programs.escape = linkProgram(vertexShader, fragmentShader);
+    programs.reproject = linkProgram(vertexShader, reprojectShader);
+    programs.composite = linkProgram(vertexShader, compositeShader);
+    programs.escapeCenter = glGetUniformLocation(programs.escape, "center");
+    programs.escapeScale = glGetUniformLocation(programs.escape, "scale");
+    programs.escapeMaxIter = glGetUniformLocation(programs.escape, "maxIter");
+    programs.escapePixelSize = glGetUniformLocation(programs.escape, "pixelSize");
+    programs.escapeColoring = glGetUniformLocation(programs.escape, "coloring");
+    programs.reprojectCenter = glGetUniformLocation(programs.reproject, "center");
+    programs.reprojectScale = glGetUniformLocation(programs.reproject, "scale");
+    programs.reprojectPreviousCenter = glGetUniformLocation(programs.reproject, "previousCenter");
+    programs.reprojectPreviousScale = glGetUniformLocation(programs.reproject, "previousScale");
+    programs.compositeRefining = glGetUniformLocation(programs.composite, "refining");
+    programs.compositeRefinedRows = glGetUniformLocation(programs.composite, "refinedRows");
+    programs.compositeColoring = glGetUniformLocation(programs.composite, "coloring");
+    programs.compositeLogMax = glGetUniformLocation(programs.composite, "logMax");
+    glUseProgram(programs.reproject);
+    glUniform1i(glGetUniformLocation(programs.reproject, "previous"), 4);
+    glUseProgram(programs.composite);
+    const char* levelNames[] = { "level0", "level1", "level2", "level3" };
+    for (int k = 0; k < refineLevels; k++) glUniform1i(glGetUniformLocation(programs.composite, levelNames[k]), k);
+    glUniform1i(glGetUniformLocation(programs.composite, "reprojected"), 4);
+    glUniform1i(glGetUniformLocation(programs.composite, "palette"), 5);
+    glUniform1i(glGetUniformLocation(programs.composite, "cdf"), 6);
+    glUniform1i(glGetUniformLocation(programs.composite, "bins"), histogramBins);
+    // --de also starts the viewer in distance colouring
+    if (distanceEstimate) coloring = COLOR_DISTANCE;
+    setColoring(programs, coloring);
 
-    GLint posAttrib = glGetAttribLocation(shaderProgram, "position");
-    glEnableVertexAttribArray(posAttrib);
-    glVertexAttribPointer(posAttrib, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    GLuint palette = makePalette();
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_1D, palette);
+    GLuint histogramProgram = linkProgram(histogramVShader, histogramFShader);
+    GLuint scanProgram = linkProgram(vertexShader, scanShader);
+    Equalizer equalizer;
+    makeEqualizer(equalizer, histogramProgram, scanProgram);
+    // the composite reads unit 6 before the first histogram exists; an
+    // all-zero one makes it fall back to the smooth palette
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_2D, equalizer.counts.texture);
 
-    //GLint uniVos = glGetUniformLocation(shaderProgram, "viewPos");
-    //glUniform3fv(uniVos, 1, glm::value_ptr(viewPos));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
 
-    while (true) {
-        if (SDL_PollEvent(&windowEvent)) {
-            if (windowEvent.type == SDL_QUIT) break;
-            if (windowEvent.type == SDL_KEYUP) {
-                if (windowEvent.key.keysym.sym == SDLK_ESCAPE) break;
+    Refiner refiner;
+    makeRefiner(refiner, view);
+    const CpuView home = view;
+    bool restart = true;
+
+    // drag to pan, wheel or +/- to zoom, arrows to pan by a tenth, R to reset,
+    // C to cycle gray, smooth and equalized colouring, D to switch to
+    // distance estimation and back
+    Coloring palettedColoring = coloring == COLOR_DISTANCE ? COLOR_EQUALIZED : coloring;
+    bool running = true;
+    while (running) {
+        while (SDL_PollEvent(&windowEvent)) {
+            if (windowEvent.type == SDL_QUIT) running = false;
+            else if (windowEvent.type == SDL_KEYUP && windowEvent.key.keysym.sym == SDLK_ESCAPE) running = false;
+            else if (windowEvent.type == SDL_MOUSEMOTION && (windowEvent.motion.state & SDL_BUTTON_LMASK)) {
+                view.centerX -= windowEvent.motion.xrel * 2.0 * view.scale / view.width;
+                view.centerY += windowEvent.motion.yrel * 2.0 * view.scale / view.height;
+                restart = true;
+            }
+            else if (windowEvent.type == SDL_MOUSEWHEEL && windowEvent.wheel.y != 0) {
+                int x, y;
+                SDL_GetMouseState(&x, &y);
+                zoomView(view, pow(0.8, windowEvent.wheel.y), x, y);
+                restart = true;
+            }
+            else if (windowEvent.type == SDL_KEYDOWN) {
+                SDL_Keycode key = windowEvent.key.keysym.sym;
+                double step = 0.1 * view.scale;
+                if (key == SDLK_LEFT) view.centerX -= step;
+                else if (key == SDLK_RIGHT) view.centerX += step;
+                else if (key == SDLK_UP) view.centerY += step;
+                else if (key == SDLK_DOWN) view.centerY -= step;
+                else if (key == SDLK_EQUALS || key == SDLK_KP_PLUS) zoomView(view, 0.8, view.width / 2, view.height / 2);
+                else if (key == SDLK_MINUS || key == SDLK_KP_MINUS) zoomView(view, 1.25, view.width / 2, view.height / 2);
+                else if (key == SDLK_r) view = home;
+                else if (key == SDLK_c || key == SDLK_d) {
+                    if (key == SDLK_d) coloring = coloring == COLOR_DISTANCE ? palettedColoring : COLOR_DISTANCE;
+                    else coloring = coloring >= COLOR_EQUALIZED ? COLOR_GRAY : (Coloring) (coloring + 1);
+                    if (coloring != COLOR_DISTANCE) palettedColoring = coloring;
+                    setColoring(programs, coloring);
+                    refiner.hasShown = false;
+                }
+                else continue;
+                restart = true;
             }
         }
 
-        glClearColor(0.0f, 0.2f, 0.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
+        if (restart) {
+            restartRefiner(refiner, programs, view);
+            restart = false;
+        }
+        if (refiner.refining < refineLevels || !refiner.hasShown) {
+            refine(refiner, programs, view, budgetMs);
+            // equalize over the finest finished level, the only one run to
+            // maxIter once it is done, sampled down to eighth resolution: the
+            // 130k samples of a 4K frame give the same shares as all of it
+            if (coloring == COLOR_EQUALIZED && refiner.refining > 0) {
+                int finished = refiner.refining - 1;
+                equalize(equalizer, refiner.levels[finished], 1 << finished, refiner.iterations[finished], vao);
+            }
+            composite(refiner, programs, view, equalizer.logMax);
+        }
 
-        glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, refiner.display.fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, view.width, view.height, 0, 0, view.width, view.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
 
         SDL_GL_SwapWindow(window);
     }
 
-    glDeleteProgram(shaderProgram);
+    if (equalizer.frames > 0) {
+        printf("Histogram equalization: %.3f ms per frame over %d frames\n", equalizer.totalMs / equalizer.frames,
+            equalizer.frames);
+    }
+    deleteEqualizer(equalizer);
+    glDeleteTextures(1, &palette);
+    glDeleteProgram(histogramProgram);
+    glDeleteProgram(scanProgram);
+    deleteRefiner(refiner);
+    glDeleteProgram(programs.escape);
+    glDeleteProgram(programs.reproject);
+    glDeleteProgram(programs.composite);
+    glDeleteShader(compositeShader);
+    glDeleteShader(scanShader);
+    glDeleteShader(histogramFShader);
+    glDeleteShader(histogramVShader);
+    glDeleteShader(reprojectShader);
     glDeleteShader(fragmentShader);
     glDeleteShader(vertexShader);
     glDeleteBuffers(1, &vbo);
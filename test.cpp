@@ -2,98 +2,622 @@
 #include <GL/glew.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
+#ifdef HEADLESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include "SOIL/src/SOIL.h"
+#include "SOIL/src/image_helper.h"
+extern "C" {
+#include "SOIL/src/image_DXT.h"
+}
 #include "GLM/glm/glm.hpp"
 #include "GLM/glm/gtc/matrix_transform.hpp"
 #include "GLM/glm/gtc/type_ptr.hpp"
+#include "GLM/glm/gtc/packing.hpp"
 #include <chrono>
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+#include <cstddef>
+#include <cstdlib>
+#include <cfloat>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <set>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
 
-const GLchar* vertexSource = R"glsl(
-    #version 150 core
+// Vertex inputs of the mesh arena, declared by makeMeshShader. Shaders read
+// the mesh through meshPosition(), on the unit sphere for globes, and
+// meshNormal(); texcoord is always an attribute.
+const GLchar* meshInputsSource = R"glsl(
     in vec3 position;
+    in vec3 normal;
+    in vec2 texcoord;
+
+    vec3 meshPosition()
+    {
+        return position;
+    }
+
+    vec3 meshNormal()
+    {
+        return normalize(normal);
+    }
+)glsl";
+
+// VERTEX_UV: makeGlobe puts texcoord (s, t) at longitude 2 pi s and
+// colatitude pi t, which is all that is needed to rebuild the vertex.
+const GLchar* meshUvInputsSource = R"glsl(
     in vec2 texcoord;
 
+    vec3 meshPosition()
+    {
+        float u = 6.2831853 * texcoord.x;
+        float v = 3.1415927 * texcoord.y;
+        return vec3(cos(u) * sin(v), sin(u) * sin(v), cos(v));
+    }
+
+    vec3 meshNormal()
+    {
+        return meshPosition();
+    }
+)glsl";
+
+const GLchar* vertexSource = R"glsl(
+    #version 150 core
+    in mat4 model;
+    in float layer;
+    in float radius;
+    in float fade;
+
     out vec2 Texcoord;
+    out vec3 WorldPos;
     out vec3 Normal;
+    out vec4 ShadowCoord;
+    flat out float Layer;
+    flat out float Fade;
 
-    uniform mat4 transl;
-    uniform mat4 rotate;
-    uniform mat4 view;
-    uniform mat4 proj;
+    layout(std140) uniform Frame {
+        mat4 view;
+        mat4 proj;
+        vec4 lightColor;
+        vec4 lightPos;
+        vec4 viewPos;
+    };
+
+    uniform mat4 shadowMatrix; // world to shadow map texture space
 
     void main()
     {
         Texcoord = texcoord;
-        Normal = vec3(rotate * vec4(position, 1.0));
-        gl_Position = proj * view * rotate * transl * vec4(position, 1.0);
+        Layer = layer;
+        Fade = fade;
+        // model matrices are rigid, so their upper 3x3 is the normal matrix
+        Normal = mat3(model) * meshNormal();
+        vec4 world = model * vec4(meshPosition() * radius, 1.0);
+        WorldPos = world.xyz;
+        ShadowCoord = shadowMatrix * world;
+        gl_Position = proj * view * world;
     }
 )glsl";
 
 const GLchar* sunVSource = R"glsl(
     #version 150 core
-    in vec3 position;
+    in mat4 model;
+    in float radius;
+    in float fade;
 
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 proj;
+    flat out float Fade;
+
+    layout(std140) uniform Frame {
+        mat4 view;
+        mat4 proj;
+        vec4 lightColor;
+        vec4 lightPos;
+        vec4 viewPos;
+    };
 
     void main()
     {
-        gl_Position = proj * view * model * vec4(position, 1.0);
+        Fade = fade;
+        gl_Position = proj * view * model * vec4(meshPosition() * radius, 1.0);
     }
 )glsl";
 
 const GLchar* fragmentSource = R"glsl(
     #version 150 core
     in vec2 Texcoord;
+    in vec3 WorldPos;
     in vec3 Normal;
+    in vec4 ShadowCoord;
+    flat in float Layer;
+    flat in float Fade;
 
     out vec4 outColor;
 
-    uniform sampler2D currTexture;
-    uniform vec3 lightColor;
-    uniform vec3 lightPos;
-    uniform vec3 viewPos;
+    uniform sampler2DArray textures;
+
+    uniform sampler2DShadow shadowMap;
+    uniform vec2 shadowTexel;
+    uniform int shadows; // 0 when there is no shadow map
+
+    // virtual texture standing in for one layer; see VirtualTexture
+    uniform sampler2D vtAtlas;
+    uniform sampler2D vtIndirection;
+    uniform int vtLayer; // -1 when there is none
+    uniform vec4 vtInfo; // level 0 tiles x, tiles y, texels per tile, border texels
+    uniform vec2 vtExtent; // share of the level 0 tiles the image covers
+    uniform float vtAtlasSize;
+    uniform float vtMaxLevel;
+
+    layout(std140) uniform Frame {
+        mat4 view;
+        mat4 proj;
+        vec4 lightColor;
+        vec4 lightPos;
+        vec4 viewPos;
+    };
+
+    vec4 sampleVirtual(vec2 uv)
+    {
+        vec2 texel = uv * vtInfo.xy * vtInfo.z;
+        vec2 dx = dFdx(texel), dy = dFdy(texel);
+        float level = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy)))), 0.0, vtMaxLevel);
+        // slot x, slot y and level of the finest resident tile covering uv
+        vec3 entry = floor(textureLod(vtIndirection, uv, level).xyz * 255.0 + 0.5);
+        vec2 local = fract(uv * vtInfo.xy / exp2(entry.z));
+        vec2 atlasTexel = entry.xy * (vtInfo.z + 2.0 * vtInfo.w) + vtInfo.w + local * vtInfo.z;
+        return textureLod(vtAtlas, atlasTexel / vtAtlasSize, 0.0);
+    }
+
+    // Fraction of the light reaching the fragment. Four bilinear depth
+    // compares half a texel apart cover a 3x3 texel footprint.
+    float lightVisibility()
+    {
+        if (shadows == 0) return 1.0;
+        vec3 coord = ShadowCoord.xyz; // orthographic, so w is 1
+        float sum = texture(shadowMap, vec3(coord.xy + vec2(-0.5, -0.5) * shadowTexel, coord.z));
+        sum += texture(shadowMap, vec3(coord.xy + vec2(0.5, -0.5) * shadowTexel, coord.z));
+        sum += texture(shadowMap, vec3(coord.xy + vec2(-0.5, 0.5) * shadowTexel, coord.z));
+        sum += texture(shadowMap, vec3(coord.xy + vec2(0.5, 0.5) * shadowTexel, coord.z));
+        return sum * 0.25;
+    }
+
+    // 4x4 ordered dither thresholds in (0, 1)
+    float bayer(vec2 p)
+    {
+        int x = int(mod(p.x, 4.0));
+        int y = int(mod(p.y, 4.0));
+        int m[16] = int[16](0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5);
+        return (float(m[y * 4 + x]) + 0.5) / 16.0;
+    }
 
     void main()
     {
-        vec4 texture = texture(currTexture, Texcoord);
+        // sample first so the dither discard cannot break the derivatives
+        vec4 texture = int(Layer) == vtLayer ? sampleVirtual(Texcoord * vtExtent) : texture(textures, vec3(Texcoord, Layer));
+        // Fade > 0 keeps the pixels below the threshold, Fade < 0 the complement,
+        // so the two LOD levels of a cross-fade never cover the same pixel
+        float threshold = bayer(gl_FragCoord.xy);
+        if (Fade > 0.0 ? threshold >= Fade : threshold < -Fade) discard;
+
         float ambientStrength = 0.01;
-        vec3 ambient = ambientStrength * lightColor;
+        vec3 ambient = ambientStrength * lightColor.rgb;
 
+        // everything is in world space
         vec3 norm = normalize(Normal);
-        vec3 lightDir = normalize(lightPos - Normal);
+        vec3 lightDir = normalize(lightPos.xyz - WorldPos);
         float diff = max(dot(norm, lightDir), 0.0);
-        vec3 diffuse = diff * lightColor;
+        vec3 diffuse = diff * lightColor.rgb;
 
         float specularStrength = 1.0;
-        vec3 viewDir = normalize(viewPos - Normal);
-        vec3 reflectDir = reflect(-lightDir, norm);  
+        vec3 viewDir = normalize(viewPos.xyz - WorldPos);
+        vec3 reflectDir = reflect(-lightDir, norm);
         float spec = pow(max(dot(viewDir, reflectDir), 0.0), 8);
-        vec3 specular = specularStrength * spec * lightColor;
+        vec3 specular = specularStrength * spec * lightColor.rgb;
 
-        vec4 result = vec4(ambient + diffuse + specular, 1.0);
+        vec4 result = vec4(ambient + lightVisibility() * (diffuse + specular), 1.0);
         outColor = texture * result;
     }
 )glsl";
 
+// Writes the virtual texture tile (x, y, level, 1) each pixel would sample,
+// rendered at reduced resolution with vtLodBias compensating for the scale.
+const GLchar* feedbackFSource = R"glsl(
+    #version 150 core
+    in vec2 Texcoord;
+    flat in float Layer;
+
+    out uvec4 outTile;
+
+    uniform int vtLayer;
+    uniform vec4 vtInfo;
+    uniform vec2 vtExtent;
+    uniform float vtMaxLevel;
+    uniform float vtLodBias;
+
+    void main()
+    {
+        if (int(Layer) != vtLayer) {
+            outTile = uvec4(0u);
+            return;
+        }
+        vec2 uv = Texcoord * vtExtent;
+        vec2 texel = uv * vtInfo.xy * vtInfo.z;
+        vec2 dx = dFdx(texel), dy = dFdy(texel);
+        float level = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + vtLodBias), 0.0, vtMaxLevel);
+        vec2 tiles = vtInfo.xy / exp2(level);
+        vec2 tile = floor(uv * tiles);
+        tile = vec2(mod(tile.x, tiles.x), clamp(tile.y, 0.0, tiles.y - 1.0));
+        outTile = uvec4(uvec2(tile), uint(level), 1u);
+    }
+)glsl";
+
 const GLchar* sunFSource = R"glsl(
     #version 150 core
+    flat in float Fade;
+
     out vec4 FragColor;
 
-    uniform vec3 lightColor;
-    
+    uniform float emission; // above 1 only when rendering HDR
+
+    layout(std140) uniform Frame {
+        mat4 view;
+        mat4 proj;
+        vec4 lightColor;
+        vec4 lightPos;
+        vec4 viewPos;
+    };
+
+    // the LOD cross-fade mask of fragmentSource
+    float bayer(vec2 p)
+    {
+        int x = int(mod(p.x, 4.0));
+        int y = int(mod(p.y, 4.0));
+        int m[16] = int[16](0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5);
+        return (float(m[y * 4 + x]) + 0.5) / 16.0;
+    }
+
     void main()
     {
-        FragColor = vec4(lightColor, 1.0); // set all 4 vector values to 1.0
+        float threshold = bayer(gl_FragCoord.xy);
+        if (Fade > 0.0 ? threshold >= Fade : threshold < -Fade) discard;
+        FragColor = vec4(lightColor.rgb * emission, 1.0);
     }
 )glsl";
 
-GLuint makeShader(GLenum type, const GLchar* source) {
+// Depth-only pass from the light; the fragment stage writes nothing.
+const GLchar* shadowVSource = R"glsl(
+    #version 150 core
+    in mat4 model;
+    in float radius;
+
+    uniform mat4 lightViewProj;
+
+    void main()
+    {
+        gl_Position = lightViewProj * model * vec4(meshPosition() * radius, 1.0);
+    }
+)glsl";
+
+const GLchar* shadowFSource = R"glsl(
+    #version 150 core
+
+    void main()
+    {
+    }
+)glsl";
+
+// Spheres too small on screen for their mesh to matter are drawn as a quad
+// facing the camera. The fragment shader intersects the view ray with the
+// sphere, writes the true depth and looks the texture up from the hit normal.
+const GLchar* impostorVSource = R"glsl(
+    #version 150 core
+    in mat4 model;
+    in float layer;
+    in float radius;
+
+    out vec3 ViewPos;
+    flat out vec3 Center;
+    flat out float Radius;
+    flat out float Layer;
+    flat out mat3 ViewToObject;
+
+    layout(std140) uniform Frame {
+        mat4 view;
+        mat4 proj;
+        vec4 lightColor;
+        vec4 lightPos;
+        vec4 viewPos;
+    };
+
+    void main()
+    {
+        vec3 center = vec3(view * model * vec4(0.0, 0.0, 0.0, 1.0));
+        float dist = length(center);
+        // half-size of a quad through the centre that contains the sphere's silhouette cone
+        float size = radius * dist / sqrt(max(dist * dist - radius * radius, 1e-6));
+        vec3 forward = center / dist;
+        vec3 right = normalize(cross(forward, abs(forward.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+        vec3 up = cross(right, forward);
+        // the quad's texcoords are its corners mapped to [0, 1], which every vertex format keeps
+        vec2 corner = texcoord * 2.0 - 1.0;
+        ViewPos = center + (corner.x * right + corner.y * up) * size;
+        Center = center;
+        Radius = radius;
+        Layer = layer;
+        // model and view are rigid, so their inverses are transposes
+        ViewToObject = transpose(mat3(model)) * transpose(mat3(view));
+        gl_Position = proj * vec4(ViewPos, 1.0);
+    }
+)glsl";
+
+const GLchar* impostorFSource = R"glsl(
+    #version 150 core
+    in vec3 ViewPos;
+    flat in vec3 Center;
+    flat in float Radius;
+    flat in float Layer;
+    flat in mat3 ViewToObject;
+
+    out vec4 outColor;
+
+    uniform sampler2DArray textures;
+
+    layout(std140) uniform Frame {
+        mat4 view;
+        mat4 proj;
+        vec4 lightColor;
+        vec4 lightPos;
+        vec4 viewPos;
+    };
+
+    const float pi = 3.1415926;
+
+    void main()
+    {
+        vec3 dir = normalize(ViewPos);
+        float b = dot(dir, Center);
+        float disc = b * b - dot(Center, Center) + Radius * Radius;
+        // discard only after sampling: neighbours need finite texcoords for the mip derivatives
+        bool miss = disc < 0.0;
+        vec3 hit = dir * (b - sqrt(max(disc, 0.0)));
+        vec4 clip = proj * vec4(hit, 1.0);
+        gl_FragDepth = (clip.z / clip.w) * 0.5 + 0.5;
+
+        // same equirectangular mapping makeGlobe uses for its texcoords
+        vec3 objectNormal = ViewToObject * ((hit - Center) / Radius);
+        float u = atan(objectNormal.y, objectNormal.x);
+        float v = acos(clamp(objectNormal.z, -1.0, 1.0));
+        // u wraps at the meridian; unwrap its derivatives so the seam does not
+        // fall through to the smallest mip
+        vec2 uv = vec2(fract(u / (2.0 * pi)), v / pi);
+        vec2 dx = dFdx(uv), dy = dFdy(uv);
+        dx.x -= round(dx.x);
+        dy.x -= round(dy.x);
+        vec4 texture = textureGrad(textures, vec3(uv, Layer), dx, dy);
+        if (miss) discard;
+
+        // lighting mirrors fragmentSource, in world space; view is rigid
+        mat3 viewToWorld = transpose(mat3(view));
+        vec3 worldPos = viewToWorld * (hit - view[3].xyz);
+        vec3 norm = viewToWorld * ((hit - Center) / Radius);
+        float ambientStrength = 0.01;
+        vec3 ambient = ambientStrength * lightColor.rgb;
+
+        vec3 lightDir = normalize(lightPos.xyz - worldPos);
+        float diff = max(dot(norm, lightDir), 0.0);
+        vec3 diffuse = diff * lightColor.rgb;
+
+        float specularStrength = 1.0;
+        vec3 viewDir = normalize(viewPos.xyz - worldPos);
+        vec3 reflectDir = reflect(-lightDir, norm);
+        float spec = pow(max(dot(viewDir, reflectDir), 0.0), 8);
+        vec3 specular = specularStrength * spec * lightColor.rgb;
+
+        vec4 result = vec4(ambient + diffuse + specular, 1.0);
+        outColor = texture * result;
+    }
+)glsl";
+
+// Fullscreen triangle for the post-processing passes, generated from
+// gl_VertexID so it needs no vertex data; any VAO can be bound.
+const GLchar* postVSource = R"glsl(
+    #version 150 core
+    out vec2 Texcoord;
+
+    void main()
+    {
+        vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+        Texcoord = corner;
+        gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+    }
+)glsl";
+
+// One step down the bloom chain. The centre and four diagonal bilinear taps,
+// a texel out, cover a 4x4 block of the source with five fetches. The first
+// step also keeps only what is brighter than the threshold, with a soft knee
+// so highlights do not switch on abruptly.
+const GLchar* bloomDownFSource = R"glsl(
+    #version 150 core
+    in vec2 Texcoord;
+
+    out vec4 outColor;
+
+    uniform sampler2D source;
+    uniform vec2 texel; // one source texel in uv
+    uniform float threshold; // negative to pass everything
+    uniform float knee;
+
+    void main()
+    {
+        vec3 sum = texture(source, Texcoord).rgb * 4.0;
+        sum += texture(source, Texcoord + vec2(-texel.x, -texel.y)).rgb;
+        sum += texture(source, Texcoord + vec2(texel.x, -texel.y)).rgb;
+        sum += texture(source, Texcoord + vec2(-texel.x, texel.y)).rgb;
+        sum += texture(source, Texcoord + vec2(texel.x, texel.y)).rgb;
+        vec3 color = sum / 8.0;
+        if (threshold >= 0.0) {
+            float brightness = max(color.r, max(color.g, color.b));
+            float soft = clamp(brightness - threshold + knee, 0.0, 2.0 * knee);
+            soft = soft * soft / (4.0 * knee + 1e-4);
+            color *= max(soft, brightness - threshold) / max(brightness, 1e-4);
+        }
+        outColor = vec4(color, 1.0);
+    }
+)glsl";
+
+// One step up the chain: a 3x3 tent over the smaller level, added onto the
+// larger one by the blend state.
+const GLchar* bloomUpFSource = R"glsl(
+    #version 150 core
+    in vec2 Texcoord;
+
+    out vec4 outColor;
+
+    uniform sampler2D source;
+    uniform vec2 texel;
+
+    void main()
+    {
+        vec3 sum = texture(source, Texcoord).rgb * 4.0;
+        sum += (texture(source, Texcoord + vec2(-texel.x, 0.0)).rgb + texture(source, Texcoord + vec2(texel.x, 0.0)).rgb +
+            texture(source, Texcoord + vec2(0.0, -texel.y)).rgb + texture(source, Texcoord + vec2(0.0, texel.y)).rgb) * 2.0;
+        sum += texture(source, Texcoord + vec2(-texel.x, -texel.y)).rgb + texture(source, Texcoord + vec2(texel.x, -texel.y)).rgb +
+            texture(source, Texcoord + vec2(-texel.x, texel.y)).rgb + texture(source, Texcoord + vec2(texel.x, texel.y)).rgb;
+        outColor = vec4(sum / 16.0, 1.0);
+    }
+)glsl";
+
+// Adds the bloom to the HDR scene and maps it to display range with the
+// Narkowicz fit of the ACES filmic curve.
+const GLchar* tonemapFSource = R"glsl(
+    #version 150 core
+    in vec2 Texcoord;
+
+    out vec4 outColor;
+
+    uniform sampler2D scene;
+    uniform sampler2D bloom;
+    uniform float exposure;
+    uniform float bloomStrength;
+
+    void main()
+    {
+        vec3 color = texture(scene, Texcoord).rgb + bloomStrength * texture(bloom, Texcoord).rgb;
+        color *= exposure;
+        color = clamp(color * (2.51 * color + 0.03) / (color * (2.43 * color + 0.59) + 0.14), 0.0, 1.0);
+        outColor = vec4(color, 1.0);
+    }
+)glsl";
+
+// GL calls issued by the render loop, reset every frame so the cost of a
+// frame can be compared across changes.
+struct FrameStats {
+    unsigned glCalls;
+    unsigned uniformUploads;
+    unsigned uniformsSkipped;
+    unsigned draws;
+    unsigned stateChanges; // program, VAO, texture and buffer binds
+    unsigned stateSkipped; // binds dropped by the state cache as redundant
+    unsigned bytesUploaded;
+    unsigned bodies;
+    unsigned frustumCulled;
+    unsigned occlusionCulled;
+};
+
+FrameStats frameStats;
+
+#define GLCALL(call) (frameStats.glCalls++, call)
+
+// Last program, VAO, array buffer and per-unit textures bound through the
+// helpers below, which drop binds that would not change anything. Code that
+// binds directly must call resetGLState() before the helpers are used again.
+const GLuint unknownBinding = ~0u;
+const int cachedTextureUnits = 8;
+
+struct GLStateCache {
+    GLuint program;
+    GLuint vao;
+    GLuint arrayBuffer;
+    GLenum activeUnit;
+    GLuint textures[cachedTextureUnits];
+};
+
+GLStateCache glState;
+
+void resetGLState() {
+    glState.program = unknownBinding;
+    glState.vao = unknownBinding;
+    glState.arrayBuffer = unknownBinding;
+    glState.activeUnit = 0;
+    for (int i = 0; i < cachedTextureUnits; i++) glState.textures[i] = unknownBinding;
+}
+
+void useProgram(GLuint program) {
+    if (glState.program == program) {
+        frameStats.stateSkipped++;
+        return;
+    }
+    glState.program = program;
+    frameStats.stateChanges++;
+    GLCALL(glUseProgram(program));
+}
+
+void bindVertexArray(GLuint vao) {
+    if (glState.vao == vao) {
+        frameStats.stateSkipped++;
+        return;
+    }
+    glState.vao = vao;
+    frameStats.stateChanges++;
+    GLCALL(glBindVertexArray(vao));
+}
+
+void bindArrayBuffer(GLuint buffer) {
+    if (glState.arrayBuffer == buffer) {
+        frameStats.stateSkipped++;
+        return;
+    }
+    glState.arrayBuffer = buffer;
+    frameStats.stateChanges++;
+    GLCALL(glBindBuffer(GL_ARRAY_BUFFER, buffer));
+}
+
+// Each unit is assumed to be used with a single target.
+void bindTexture(GLenum unit, GLenum target, GLuint texture) {
+    GLuint &bound = glState.textures[unit - GL_TEXTURE0];
+    if (bound == texture) {
+        frameStats.stateSkipped++;
+        return;
+    }
+    if (glState.activeUnit != unit) {
+        glState.activeUnit = unit;
+        GLCALL(glActiveTexture(unit));
+    }
+    bound = texture;
+    frameStats.stateChanges++;
+    GLCALL(glBindTexture(target, texture));
+}
+
+GLuint compileShader(GLenum type, GLsizei count, const GLchar** sources, const GLint* lengths) {
     GLuint id = glCreateShader(type);
-    glShaderSource(id, 1, &source, NULL);
+    glShaderSource(id, count, sources, lengths);
     glCompileShader(id);
     GLint status;
 
@@ -109,253 +633,3595 @@ GLuint makeShader(GLenum type, const GLchar* source) {
     return id;
 }
 
-void makeTexture(const char* filename, const char* shadername, GLenum id, size_t i, GLuint *textures, GLuint shaderProgram) {
-    glActiveTexture(id);
-    glBindTexture(GL_TEXTURE_2D, textures[i]);
-    int width, height;
-    unsigned char* image = SOIL_load_image(filename, &width, &height, 0, SOIL_LOAD_RGB);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-    SOIL_free_image_data(image);
-    glUniform1i(glGetUniformLocation(shaderProgram, shadername), (int) i);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+GLuint makeShader(GLenum type, const GLchar* source) {
+    return compileShader(type, 1, &source, NULL);
+}
+
+// How a streamed array is stored and sampled. RGB8 is usually padded to four
+// bytes per texel in VRAM; DXT1 packs a 4x4 block into eight bytes.
+struct TextureSettings {
+    const char* label;
+    bool compress;
+    GLint minFilter;
+    float anisotropy; // 1 for plain trilinear
+};
+
+// Decoded image with its full mip chain, finest level first, waiting for upload.
+struct StreamedImage {
+    int layer;
+    std::vector<std::vector<unsigned char> > levels;
+};
+
+// Streams images into the layers of a GL_TEXTURE_2D_ARRAY without blocking the
+// render thread. Workers decode, resample and build mip chains; each frame
+// pumpStreamer copies rows into a ring of PBO slots (persistently mapped with
+// ARB_buffer_storage) and issues glTexSubImage3D from them, fenced so a slot
+// is only rewritten once the GPU has consumed it. Levels go up coarsest first,
+// and GL_TEXTURE_BASE_LEVEL tracks the finest level every layer has, so a grey
+// 1x1 placeholder is replaced by a blurry version long before the full image.
+struct TextureStreamer {
+    GLuint texture;
+    GLenum unit;
+    TextureSettings settings;
+    int width, height, layers, levelCount;
+    int baseLevel;
+    std::vector<int> residentLevel; // per layer; levelCount when nothing is resident
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::pair<int, std::string> > requests;
+    std::deque<StreamedImage*> decoded;
+    bool done;
+
+    GLuint pbo;
+    bool persistent;
+    char* mapped;
+    size_t slotBytes;
+    std::vector<GLsync> fences;
+    size_t nextSlot;
+    std::vector<StreamedImage*> uploading;
+    int uploadLevel, uploadRow; // progress through uploading[0], in pixel or block rows
+    size_t pendingImages;
+};
+
+const int streamerSlots = 4;
+const size_t streamerSlotBytes = 4 << 20;
+
+int levelSize(int size, int level) {
+    return std::max(1, size >> level);
 }
 
-void addVertices(float d, float u, float v, std::vector<float> &vertices, float pi) {
-    vertices.push_back(d * cos(u)*sin(v)); // x
-    vertices.push_back(d * sin(u)*sin(v)); // y
-    vertices.push_back(d * cos(v)); // z
-    vertices.push_back(u / (2 * pi)); // tex x
-    vertices.push_back(v / pi); // tex y
-    // vertices.push_back(d * cos(u)*sin(v)); // norm x
-    // vertices.push_back(d * sin(u)*sin(v)); // norm y
-    // vertices.push_back(d * cos(v)); // norm z
+// Pixel rows covered by one upload row: a DXT block row spans four.
+int uploadRowPixels(const TextureStreamer &streamer) {
+    return streamer.settings.compress ? 4 : 1;
 }
 
-std::vector<float> makeGlobe(float d, int res) {
-    std::vector<float> vertices;
-    float pi = 3.1415926;
-    float safe = 0.00001;
-    vertices.reserve(6 * 5 * 2 * res * res);
-    for (float u = 0.0; u < (2 * pi) - safe; u += pi / res) {
-        for (float v = 0.0; v < pi - safe; v += pi / res) {
-            addVertices(d, u, v, vertices, pi);
-            addVertices(d, u + pi / res, v, vertices, pi);
-            addVertices(d, u, v + pi / res, vertices, pi);
-            addVertices(d, u + pi / res, v, vertices, pi);
-            addVertices(d, u, v + pi / res, vertices, pi);
-            addVertices(d, u + pi / res, v + pi / res, vertices, pi);
+size_t uploadRowBytes(const TextureStreamer &streamer, int level) {
+    int w = levelSize(streamer.width, level);
+    return streamer.settings.compress ? (size_t) (w + 3) / 4 * 8 : (size_t) w * 3;
+}
+
+// VRAM used by the whole array; RGB8 counts as RGBA8, which is what drivers allocate.
+size_t textureFootprint(const TextureStreamer &streamer, bool compressed) {
+    size_t bytes = 0;
+    for (int level = 0; level < streamer.levelCount; level++) {
+        size_t w = levelSize(streamer.width, level), h = levelSize(streamer.height, level);
+        bytes += compressed ? (w + 3) / 4 * ((h + 3) / 4) * 8 : w * h * 4;
+    }
+    return bytes * streamer.layers;
+}
+
+// Reads the pixel size from a JPEG or PNG header without decoding (SOIL's
+// stbi_info is declared but not implemented). Other formats decode in full.
+bool readImageSize(const char* filename, int &width, int &height) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+    unsigned char header[24];
+    bool found = false;
+    if (fread(header, 1, 24, file) == 24 && memcmp(header, "\x89PNG", 4) == 0) {
+        width = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+        height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+        found = true;
+    }
+    else if (header[0] == 0xFF && header[1] == 0xD8) {
+        // walk the marker segments up to the first start-of-frame
+        fseek(file, 2, SEEK_SET);
+        unsigned char marker[9];
+        while (fread(marker, 1, 4, file) == 4 && marker[0] == 0xFF) {
+            int length = (marker[2] << 8) | marker[3];
+            bool startOfFrame = marker[1] >= 0xC0 && marker[1] <= 0xCF && marker[1] != 0xC4 && marker[1] != 0xC8 && marker[1] != 0xCC;
+            if (startOfFrame) {
+                if (fread(marker + 4, 1, 5, file) != 5) break;
+                height = (marker[5] << 8) | marker[6];
+                width = (marker[7] << 8) | marker[8];
+                found = true;
+                break;
+            }
+            fseek(file, length - 2, SEEK_CUR);
         }
     }
-    return vertices;
+    fclose(file);
+    if (!found) {
+        int channels;
+        unsigned char* image = SOIL_load_image(filename, &width, &height, &channels, SOIL_LOAD_AUTO);
+        if (!image) return false;
+        SOIL_free_image_data(image);
+    }
+    return true;
 }
 
-int main(int argc, char *argv[]) {
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
-    SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
-    SDL_Window* window = SDL_CreateWindow("OpenGL", 100, 100, 800, 600, SDL_WINDOW_OPENGL);
-    SDL_GLContext context = SDL_GL_CreateContext(window);
-    glewExperimental = GL_TRUE;
-    glewInit();
-    SDL_Event windowEvent;
+void decodeImage(TextureStreamer* streamer, int layer, const std::string &filename) {
+    int width, height, channels;
+    unsigned char* image = SOIL_load_image(filename.c_str(), &width, &height, &channels, SOIL_LOAD_RGB);
+    StreamedImage* result = new StreamedImage;
+    result->layer = layer;
+    result->levels.resize(streamer->levelCount);
+    std::vector<unsigned char> &base = result->levels[0];
+    base.resize(streamer->width * streamer->height * 3);
+    if (!image) {
+        printf("Failed to load %s: %s\n", filename.c_str(), SOIL_last_result());
+        std::fill(base.begin(), base.end(), 128);
+    }
+    else if (width != streamer->width || height != streamer->height) {
+        up_scale_image(image, width, height, 3, &base[0], streamer->width, streamer->height);
+    }
+    else {
+        std::copy(image, image + base.size(), base.begin());
+    }
+    if (image) SOIL_free_image_data(image);
+    for (int level = 1; level < streamer->levelCount; level++) {
+        int w = levelSize(streamer->width, level - 1), h = levelSize(streamer->height, level - 1);
+        result->levels[level].resize(levelSize(streamer->width, level) * levelSize(streamer->height, level) * 3);
+        mipmap_image(&result->levels[level - 1][0], w, h, 3, &result->levels[level][0], w > 1 ? 2 : 1, h > 1 ? 2 : 1);
+    }
+    for (int level = 0; streamer->settings.compress && level < streamer->levelCount; level++) {
+        int size;
+        unsigned char* blocks = convert_image_to_DXT1(&result->levels[level][0], levelSize(streamer->width, level),
+            levelSize(streamer->height, level), 3, &size);
+        result->levels[level].assign(blocks, blocks + size);
+        free(blocks);
+    }
+    std::lock_guard<std::mutex> lock(streamer->mutex);
+    streamer->decoded.push_back(result);
+}
 
-    GLuint eartha;
-    glGenVertexArrays(1, &eartha);
-    glBindVertexArray(eartha);
-    GLuint moona;
-    glGenVertexArrays(1, &moona);
-    glBindVertexArray(moona);
-    GLuint suna;
-    glGenVertexArrays(1, &suna);
-    glBindVertexArray(suna);
-
-    GLuint earthb;
-    glGenBuffers(1, &earthb);
-    std::vector<float> earthbuf = makeGlobe(5.0, 12);
-    GLuint moonb;
-    glGenBuffers(1, &moonb);
-    std::vector<float> moonbuf = makeGlobe(2.5, 24);
-    GLuint sunb;
-    glGenBuffers(1, &sunb);
-    std::vector<float> sunbuf = makeGlobe(6.0, 12);
-
-    glBindBuffer(GL_ARRAY_BUFFER, earthb);
-    glBufferData(GL_ARRAY_BUFFER, earthbuf.size() * 4, &earthbuf[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, moonb);
-    glBufferData(GL_ARRAY_BUFFER, moonbuf.size() * 4, &moonbuf[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, sunb);
-    glBufferData(GL_ARRAY_BUFFER, sunbuf.size() * 4, &sunbuf[0], GL_STATIC_DRAW);
-
-    GLuint vertexShader = makeShader(GL_VERTEX_SHADER, vertexSource);
-    GLuint fragmentShader = makeShader(GL_FRAGMENT_SHADER, fragmentSource);
-    GLuint sunVShader = makeShader(GL_VERTEX_SHADER, sunVSource);
-    GLuint sunFShader = makeShader(GL_FRAGMENT_SHADER, sunFSource);
+void streamerWorkerLoop(TextureStreamer* streamer) {
+    while (true) {
+        std::pair<int, std::string> request;
+        {
+            std::unique_lock<std::mutex> lock(streamer->mutex);
+            while (streamer->requests.empty() && !streamer->done) streamer->wake.wait(lock);
+            if (streamer->requests.empty()) return;
+            request = streamer->requests.front();
+            streamer->requests.pop_front();
+        }
+        decodeImage(streamer, request.first, request.second);
+    }
+}
 
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-    glUseProgram(shaderProgram);
-
-    GLuint sunProgram = glCreateProgram();
-    glAttachShader(sunProgram, sunVShader);
-    glAttachShader(sunProgram, sunFShader);
-    glLinkProgram(sunProgram);
-
-    glBindVertexArray(eartha); // to do: merge these three into one
-    glBindBuffer(GL_ARRAY_BUFFER, earthb);
-    glEnableVertexAttribArray(0);
-    GLint posAttrib = glGetAttribLocation(shaderProgram, "position");
-    glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), 0);
-    glEnableVertexAttribArray(1);
-    GLint texAttrib = glGetAttribLocation(shaderProgram, "texcoord");
-    glVertexAttribPointer(texAttrib, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (char*)(3 * sizeof(float)));
-
-    glBindVertexArray(moona);
-    glBindBuffer(GL_ARRAY_BUFFER, moonb);
-    glEnableVertexAttribArray(0);
-    posAttrib = glGetAttribLocation(shaderProgram, "position");
-    glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), 0);
-    glEnableVertexAttribArray(1);
-    texAttrib = glGetAttribLocation(shaderProgram, "texcoord");
-    glVertexAttribPointer(texAttrib, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (char*)(3 * sizeof(float)));
-
-    glUseProgram(sunProgram);
-    glBindVertexArray(suna);
-    glBindBuffer(GL_ARRAY_BUFFER, sunb);
-    glEnableVertexAttribArray(0);
-    posAttrib = glGetAttribLocation(sunProgram, "position");
-    glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), 0);
-
-    glUseProgram(shaderProgram);
-    GLuint textures[2];
-    glGenTextures(2, textures);
-    makeTexture("earth.jpg", "texEarth", GL_TEXTURE0, 0, textures, shaderProgram);
-    makeTexture("moon.jpg", "texMoon", GL_TEXTURE1, 1, textures, shaderProgram);
+// Sizes the array from the image headers, allocates it, fills every layer with
+// the placeholder and queues the files on the worker pool.
+void startStreamer(TextureStreamer &streamer, const char** filenames, int count, GLenum unit, const TextureSettings &settings) {
+    streamer.width = 1;
+    streamer.height = 1;
+    for (int i = 0; i < count; i++) {
+        int w, h;
+        if (!readImageSize(filenames[i], w, h)) continue;
+        streamer.width = std::max(streamer.width, w);
+        streamer.height = std::max(streamer.height, h);
+    }
+    streamer.unit = unit;
+    streamer.settings = settings;
+    streamer.layers = count;
+    streamer.levelCount = 1;
+    while (levelSize(streamer.width, streamer.levelCount - 1) > 1 || levelSize(streamer.height, streamer.levelCount - 1) > 1) {
+        streamer.levelCount++;
+    }
+    streamer.baseLevel = streamer.levelCount - 1;
+    streamer.residentLevel.assign(count, streamer.levelCount);
 
-    glm::vec3 lightColor(0.95f, 1.0f, 0.81f);
-    glm::vec3 lightPos(20.0f, 800.0f, 1.0f);
-    glm::vec3 viewPos(50.0f, 50.1f, 1.4f);
+    glGenTextures(1, &streamer.texture);
+    glActiveTexture(unit);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, streamer.texture);
+    GLenum format = settings.compress ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_RGB8;
+    if (GLEW_ARB_texture_storage) {
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, streamer.levelCount, format, streamer.width, streamer.height, count);
+    }
+    else {
+        for (int level = 0; level < streamer.levelCount; level++) {
+            int w = levelSize(streamer.width, level), h = levelSize(streamer.height, level);
+            if (settings.compress) {
+                size_t bytes = uploadRowBytes(streamer, level) * ((h + 3) / 4) * count;
+                std::vector<unsigned char> empty(bytes);
+                glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, w, h, count, 0, (GLsizei) bytes, &empty[0]);
+            }
+            else {
+                glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, w, h, count, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+            }
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (settings.compress) {
+        // one block per layer, both endpoints mid grey in RGB565
+        const unsigned char block[8] = { 0x10, 0x84, 0x10, 0x84, 0, 0, 0, 0 };
+        std::vector<unsigned char> grey;
+        for (int i = 0; i < count; i++) grey.insert(grey.end(), block, block + 8);
+        glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, streamer.baseLevel, 0, 0, 0, 1, 1, count, format,
+            (GLsizei) grey.size(), &grey[0]);
+    }
+    else {
+        std::vector<unsigned char> grey(count * 3, 128);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, streamer.baseLevel, 0, 0, 0, 1, 1, count, GL_RGB, GL_UNSIGNED_BYTE, &grey[0]);
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, streamer.baseLevel);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, streamer.levelCount - 1);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, settings.minFilter);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, settings.minFilter == GL_NEAREST ? GL_NEAREST : GL_LINEAR);
+    if (settings.anisotropy > 1.0f) glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, settings.anisotropy);
 
-    glm::mat4 earthmodel = glm::mat4(1.0f);
-    glm::mat4 moonmodel = glm::mat4(1.0f);
-    glm::mat4 earthposm = glm::mat4(1.0f);
-    glm::mat4 moonposm = glm::mat4(1.0f);
-    glm::mat4 sunmodel = glm::mat4(1.0f);
-    moonposm = glm::translate(
-        moonposm,
-        glm::vec3(36.0f, 0.0f, 0.0f)
-    );
-    sunmodel = glm::translate(
-        moonmodel,
-        lightPos
-    );
+    streamer.slotBytes = streamerSlotBytes;
+    streamer.persistent = GLEW_ARB_buffer_storage != 0;
+    glGenBuffers(1, &streamer.pbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.pbo);
+    size_t bytes = streamerSlots * streamer.slotBytes;
+    if (streamer.persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, flags);
+        streamer.mapped = (char*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, flags);
+    }
+    else {
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+        streamer.mapped = NULL;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    streamer.fences.assign(streamerSlots, (GLsync) 0);
+    streamer.nextSlot = 0;
+    streamer.uploadLevel = -1;
+    streamer.uploadRow = 0;
+    streamer.pendingImages = count;
 
-    glm::mat4 view = glm::lookAt(
-        viewPos,
-        glm::vec3(0.0f, 0.0f, 0.0f),
-        glm::vec3(0.0f, 0.0f, 1.0f)
-    );
+    streamer.done = false;
+    for (int i = 0; i < count; i++) streamer.requests.push_back(std::make_pair(i, std::string(filenames[i])));
+    int workerCount = std::max(1, std::min(count, (int) std::thread::hardware_concurrency() - 1));
+    for (int i = 0; i < workerCount; i++) streamer.workers.push_back(std::thread(streamerWorkerLoop, &streamer));
+}
 
-    glm::mat4 proj = glm::perspective(glm::radians(55.0f), 800.0f / 600.0f, 0.1f, 1000.0f);
+bool streamerIdle(const TextureStreamer &streamer) {
+    return streamer.pendingImages == 0;
+}
 
-    bool rotate = false;
-    auto t_start = std::chrono::high_resolution_clock::now();
-    glEnable(GL_DEPTH_TEST);
-    GLint uniView = glGetUniformLocation(shaderProgram, "view");
-    glUniformMatrix4fv(uniView, 1, GL_FALSE, glm::value_ptr(view));
-    GLint uniProj = glGetUniformLocation(shaderProgram, "proj");
-    glUniformMatrix4fv(uniProj, 1, GL_FALSE, glm::value_ptr(proj));
-    GLint uniLight = glGetUniformLocation(shaderProgram, "lightColor");
-    glUniform3fv(uniLight, 1, glm::value_ptr(lightColor));
-    GLint uniPos = glGetUniformLocation(shaderProgram, "lightPos");
-    glUniform3fv(uniPos, 1, glm::value_ptr(lightPos));
-    GLint uniVos = glGetUniformLocation(shaderProgram, "viewPos");
-    glUniform3fv(uniVos, 1, glm::value_ptr(viewPos));
+// Coarsest level still missing from any image being uploaded.
+int nextUploadLevel(const TextureStreamer &streamer) {
+    int level = -1;
+    for (size_t i = 0; i < streamer.uploading.size(); i++) {
+        level = std::max(level, streamer.residentLevel[streamer.uploading[i]->layer] - 1);
+    }
+    return level;
+}
 
-    while (true) {
-        if (SDL_PollEvent(&windowEvent)) {
-            if (windowEvent.type == SDL_QUIT) break;
-            if (windowEvent.type == SDL_KEYUP) {
-                if (windowEvent.key.keysym.sym == SDLK_ESCAPE) break;
-                if (windowEvent.key.keysym.sym == SDLK_SPACE) rotate = !rotate;
-            }
+// Uploads up to `budget` bytes of decoded rows. Returns the bytes uploaded.
+size_t pumpStreamer(TextureStreamer &streamer, size_t budget) {
+    {
+        std::lock_guard<std::mutex> lock(streamer.mutex);
+        while (!streamer.decoded.empty()) {
+            streamer.uploading.push_back(streamer.decoded.front());
+            streamer.decoded.pop_front();
         }
+    }
+    if (streamer.uploading.empty()) return 0;
 
-        auto t_now = std::chrono::high_resolution_clock::now();
-        float time = std::chrono::duration_cast<std::chrono::duration<float>>(t_now - t_start).count();
-
-        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        glUseProgram(shaderProgram);
-
-        if (rotate && time > 0.02f) {
-            t_start = t_now;
-            earthmodel = glm::rotate(
-                earthmodel,
-                glm::radians(1.0f),
-                glm::vec3(0.0f, 0.0f, 1.0f)
-            );
-            moonmodel = glm::rotate(
-                moonmodel,
-                glm::radians(-0.4f),
-                glm::vec3(0.0f, 0.0f, 1.0f)
-            );
-        }
-
-        glActiveTexture(GL_TEXTURE0);
-        glUniform1i(glGetUniformLocation(shaderProgram, "currTexture"), 0);
-        glBindVertexArray(eartha);
-        GLint uniModel = glGetUniformLocation(shaderProgram, "transl");
-        glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(earthposm));
-        uniModel = glGetUniformLocation(shaderProgram, "rotate");
-        glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(earthmodel));
-        glDrawArrays(GL_TRIANGLES, 0, earthbuf.size());
-
-        glActiveTexture(GL_TEXTURE1);
-        glUniform1i(glGetUniformLocation(shaderProgram, "currTexture"), 1);
-        glBindVertexArray(moona);
-        uniModel = glGetUniformLocation(shaderProgram, "transl");
-        glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(moonposm));
-        uniModel = glGetUniformLocation(shaderProgram, "rotate");
-        glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(moonmodel));
-        glDrawArrays(GL_TRIANGLES, 0, moonbuf.size());
-
-        glUseProgram(sunProgram);
-        glBindVertexArray(suna);
-        GLint sunModel = glGetUniformLocation(sunProgram, "model");
-        glUniformMatrix4fv(sunModel, 1, GL_FALSE, glm::value_ptr(sunmodel));
-        GLint sunView = glGetUniformLocation(sunProgram, "view");
-        glUniformMatrix4fv(sunView, 1, GL_FALSE, glm::value_ptr(view));
-        GLint sunProj = glGetUniformLocation(sunProgram, "proj");
-        glUniformMatrix4fv(sunProj, 1, GL_FALSE, glm::value_ptr(proj));
-        GLint sunLight = glGetUniformLocation(sunProgram, "lightColor");
-        glUniform3fv(sunLight, 1, glm::value_ptr(lightColor));
-        glDrawArrays(GL_TRIANGLES, 0, sunbuf.size());
+    size_t uploaded = 0;
+    bindTexture(streamer.unit, GL_TEXTURE_2D_ARRAY, streamer.texture);
+    GLCALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.pbo));
+    while (uploaded < budget && !streamer.uploading.empty()) {
+        // Work on the coarsest missing level across images so layers sharpen together.
+        int level = nextUploadLevel(streamer);
+        size_t image = 0;
+        while (streamer.residentLevel[streamer.uploading[image]->layer] - 1 != level) image++;
+        if (image != 0 || level != streamer.uploadLevel) {
+            std::swap(streamer.uploading[0], streamer.uploading[image]);
+            streamer.uploadLevel = level;
+            streamer.uploadRow = 0;
+        }
+        StreamedImage* current = streamer.uploading[0];
 
-        SDL_GL_SwapWindow(window);
+        size_t slot = streamer.nextSlot;
+        if (streamer.fences[slot]) {
+            GLenum status = GLCALL(glClientWaitSync(streamer.fences[slot], 0, 0));
+            if (status == GL_TIMEOUT_EXPIRED) break;
+            GLCALL(glDeleteSync(streamer.fences[slot]));
+            streamer.fences[slot] = 0;
+        }
+
+        int w = levelSize(streamer.width, level), h = levelSize(streamer.height, level);
+        int rowPixels = uploadRowPixels(streamer);
+        int rowCount = (h + rowPixels - 1) / rowPixels;
+        size_t rowBytes = uploadRowBytes(streamer, level);
+        size_t room = std::min(streamer.slotBytes, budget - uploaded);
+        int rows = std::min(rowCount - streamer.uploadRow, (int) std::max((size_t) 1, room / rowBytes));
+        size_t bytes = rows * rowBytes;
+        size_t offset = slot * streamer.slotBytes;
+        const unsigned char* src = &current->levels[level][streamer.uploadRow * rowBytes];
+        if (streamer.persistent) {
+            memcpy(streamer.mapped + offset, src, bytes);
+        }
+        else {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+            void* dst = GLCALL(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, bytes, flags));
+            memcpy(dst, src, bytes);
+            GLCALL(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+        }
+        int y = streamer.uploadRow * rowPixels;
+        int height = std::min(rows * rowPixels, h - y);
+        if (streamer.settings.compress) {
+            GLCALL(glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, y, current->layer, w, height, 1,
+                GL_COMPRESSED_RGB_S3TC_DXT1_EXT, (GLsizei) bytes, (char*) offset));
+        }
+        else {
+            GLCALL(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, y, current->layer, w, height, 1,
+                GL_RGB, GL_UNSIGNED_BYTE, (char*) offset));
+        }
+        streamer.fences[slot] = GLCALL(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+        streamer.nextSlot = (slot + 1) % streamerSlots;
+        uploaded += bytes;
+
+        streamer.uploadRow += rows;
+        if (streamer.uploadRow < rowCount) continue;
+        streamer.residentLevel[current->layer] = level;
+        std::vector<unsigned char>().swap(current->levels[level]);
+        streamer.uploadLevel = -1;
+        if (level == 0) {
+            streamer.uploading.erase(streamer.uploading.begin());
+            streamer.pendingImages--;
+            delete current;
+        }
+        int base = *std::max_element(streamer.residentLevel.begin(), streamer.residentLevel.end());
+        if (base < streamer.baseLevel) {
+            streamer.baseLevel = base;
+            GLCALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, base));
+        }
     }
+    GLCALL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+    frameStats.bytesUploaded += uploaded;
+    return uploaded;
+}
 
-    glDeleteProgram(shaderProgram);
-    glDeleteProgram(sunProgram);
-    glDeleteShader(fragmentShader);
-    glDeleteShader(vertexShader);
-    glDeleteShader(sunFShader);
-    glDeleteShader(sunVShader);
-    glDeleteBuffers(1, &sunb);
-    glDeleteBuffers(1, &moonb);
-    glDeleteBuffers(1, &earthb);
-    glDeleteVertexArrays(1, &suna);
-    glDeleteVertexArrays(1, &moona);
-    glDeleteVertexArrays(1, &eartha);
-
-    SDL_GL_DeleteContext(context);
-    SDL_Quit();
+void deleteStreamer(TextureStreamer &streamer) {
+    {
+        std::lock_guard<std::mutex> lock(streamer.mutex);
+        streamer.done = true;
+        streamer.requests.clear();
+        streamer.wake.notify_all();
+    }
+    for (size_t i = 0; i < streamer.workers.size(); i++) streamer.workers[i].join();
+    for (size_t i = 0; i < streamer.decoded.size(); i++) delete streamer.decoded[i];
+    for (size_t i = 0; i < streamer.uploading.size(); i++) delete streamer.uploading[i];
+    for (size_t i = 0; i < streamer.fences.size(); i++) if (streamer.fences[i]) glDeleteSync(streamer.fences[i]);
+    if (streamer.persistent) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, streamer.pbo);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &streamer.pbo);
+    glDeleteTextures(1, &streamer.texture);
+}
+
+// Virtual texturing for maps too large to decode or upload whole. An offline
+// step (--vt-build) cuts the image into a pyramid of bordered tiles stored
+// level by level in a pack file. At runtime the pack is memory mapped, a low
+// resolution feedback pass writes the tile each pixel wants, and a loader
+// thread copies those tiles out of the mapping (taking any page faults off
+// the render thread) before they go into a fixed atlas managed as an LRU
+// cache. An indirection mip chain, one texel per tile, tells fragmentSource
+// which atlas slot holds the finest resident tile covering a point. The top
+// level is pinned so every lookup has something to fall back to.
+struct VirtualTextureHeader {
+    char magic[4]; // "VTX2"
+    int content, border; // texels per tile side, excluding and per border
+    int tilesX, tilesY; // level 0 tile counts, powers of two
+    int levels;
+    int width, height; // source texels; the rest of the level 0 tiles is padding
+};
+
+// Tiles covering the image, per level, as a power of two so every level halves exactly.
+int virtualTileCount(int size, int content) {
+    int tiles = 1;
+    while (tiles * content < size) tiles *= 2;
+    return tiles;
+}
+
+// One level of the pack under construction. Only the rows its next tile row
+// needs, plus the one being paired for the level below, are held.
+struct PackLevel {
+    int width, height; // texels including padding, tiles * content
+    int imageWidth, imageHeight; // texels the source covers, rounded up
+    int tilesX, tilesY;
+    size_t firstTile; // pack index of the level's first tile
+    std::vector<unsigned char> rows; // rows [rowsIn - held, rowsIn)
+    int rowsIn, nextTileRow;
+};
+
+struct PackBuilder {
+    FILE* file;
+    int content, border, tileSize;
+    size_t tileBytes;
+    std::vector<PackLevel> levels;
+    std::vector<unsigned char> tile;
+    size_t tilesWritten;
+};
+
+// Cuts tile row level.nextTileRow out of the held rows. Columns wrap at the
+// image width on the left, where the meridian is, and rows clamp at the poles.
+// Tiles wholly in the padding are never sampled and stay holes in the file.
+bool writePackTileRow(PackBuilder &pack, PackLevel &level) {
+    int c = pack.content, b = pack.border;
+    int ty = level.nextTileRow;
+    if (ty * c >= level.imageHeight) return true;
+    size_t stride = (size_t) level.width * 3;
+    int first = level.rowsIn - (int) (level.rows.size() / stride);
+    for (int tx = 0; tx < level.tilesX && tx * c < level.imageWidth; tx++) {
+        for (int y = 0; y < pack.tileSize; y++) {
+            int sy = std::max(0, std::min(level.height - 1, ty * c - b + y));
+            const unsigned char* row = &level.rows[(size_t) (sy - first) * stride];
+            for (int x = 0; x < pack.tileSize; x++) {
+                int sx = tx * c - b + x;
+                if (sx < 0) sx = (sx % level.imageWidth + level.imageWidth) % level.imageWidth;
+                else if (sx >= level.width) sx -= level.width;
+                memcpy(&pack.tile[((size_t) y * pack.tileSize + x) * 3], &row[(size_t) sx * 3], 3);
+            }
+        }
+        size_t index = level.firstTile + (size_t) ty * level.tilesX + tx;
+        if (fseek(pack.file, (long) (sizeof(VirtualTextureHeader) + index * pack.tileBytes), SEEK_SET) != 0 ||
+            fwrite(&pack.tile[0], 1, pack.tileBytes, pack.file) != pack.tileBytes) {
+            return false;
+        }
+        pack.tilesWritten++;
+    }
+    return true;
+}
+
+// Appends one row to level l. Each pair of rows is box filtered into the next
+// level straight away, and every tile row whose texels, borders included,
+// have all arrived is written and its rows dropped.
+bool addPackRow(PackBuilder &pack, int l, const unsigned char* row) {
+    PackLevel &level = pack.levels[l];
+    size_t stride = (size_t) level.width * 3;
+    level.rows.insert(level.rows.end(), row, row + stride);
+    level.rowsIn++;
+    if (l + 1 < (int) pack.levels.size() && level.rowsIn % 2 == 0) {
+        const unsigned char* a = &level.rows[level.rows.size() - 2 * stride];
+        const unsigned char* b = a + stride;
+        std::vector<unsigned char> half(stride / 2);
+        for (size_t x = 0; x < stride / 6; x++) {
+            for (int k = 0; k < 3; k++) {
+                size_t i = x * 6 + k;
+                half[x * 3 + k] = (unsigned char) ((a[i] + a[i + 3] + b[i] + b[i + 3] + 2) / 4);
+            }
+        }
+        if (!addPackRow(pack, l + 1, &half[0])) return false;
+    }
+    int c = pack.content, b = pack.border;
+    while (level.nextTileRow < level.tilesY && level.rowsIn >= std::min(level.height, (level.nextTileRow + 1) * c + b)) {
+        if (!writePackTileRow(pack, level)) return false;
+        level.nextTileRow++;
+        int keep = std::max(0, level.nextTileRow * c - b);
+        int first = level.rowsIn - (int) (level.rows.size() / stride);
+        if (keep > first) level.rows.erase(level.rows.begin(), level.rows.begin() + (size_t) (keep - first) * stride);
+    }
+    return true;
+}
+
+// Reads a binary PPM header, leaving the file at the first row.
+bool readPpmHeader(FILE* file, int &width, int &height) {
+    int maxValue;
+    if (fscanf(file, "P6 %d %d %d", &width, &height, &maxValue) != 3 || maxValue != 255) return false;
+    return fgetc(file) != EOF && width > 0 && height > 0;
+}
+
+// Builds the pack in one pass over the source rows, so only a few tile rows
+// of each level are ever in memory. Binary PPM sources are read in strips
+// as they go; other formats are decoded whole by SOIL first. The image is
+// not resampled: the level 0 tiles are rounded up to a power of two and the
+// columns past the image repeat it from the left, the rows below it its last
+// row. The header's width and height tell the shaders how much of the tiles
+// the image covers.
+bool buildVirtualTexturePack(const char* source, const char* path, int content, int border) {
+    int width, height, channels;
+    unsigned char* image = NULL;
+    FILE* ppm = fopen(source, "rb");
+    if (ppm && !readPpmHeader(ppm, width, height)) {
+        fclose(ppm);
+        ppm = NULL;
+    }
+    if (!ppm) {
+        image = SOIL_load_image(source, &width, &height, &channels, SOIL_LOAD_RGB);
+        if (!image) {
+            printf("Failed to load %s: %s\n", source, SOIL_last_result());
+            return false;
+        }
+    }
+    VirtualTextureHeader header = { { 'V', 'T', 'X', '2' }, content, border,
+        virtualTileCount(width, content), virtualTileCount(height, content), 1, width, height };
+    while ((header.tilesX >> header.levels) > 0 && (header.tilesY >> header.levels) > 0) header.levels++;
+
+    PackBuilder pack;
+    pack.content = content;
+    pack.border = border;
+    pack.tileSize = content + 2 * border;
+    pack.tileBytes = (size_t) pack.tileSize * pack.tileSize * 3;
+    pack.tile.resize(pack.tileBytes);
+    pack.tilesWritten = 0;
+    size_t tiles = 0;
+    for (int l = 0; l < header.levels; l++) {
+        PackLevel level;
+        level.tilesX = header.tilesX >> l;
+        level.tilesY = header.tilesY >> l;
+        level.width = level.tilesX * content;
+        level.height = level.tilesY * content;
+        level.imageWidth = std::max(1, (width + (1 << l) - 1) >> l);
+        level.imageHeight = std::max(1, (height + (1 << l) - 1) >> l);
+        level.firstTile = tiles;
+        level.rowsIn = 0;
+        level.nextTileRow = 0;
+        pack.levels.push_back(level);
+        tiles += (size_t) level.tilesX * level.tilesY;
+    }
+
+    pack.file = fopen(path, "wb");
+    if (!pack.file) {
+        printf("Failed to open %s\n", path);
+        if (ppm) fclose(ppm);
+        if (image) SOIL_free_image_data(image);
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, pack.file);
+    std::vector<unsigned char> strip, padded((size_t) pack.levels[0].width * 3);
+    size_t rowBytes = (size_t) width * 3;
+    int stripRows = content;
+    bool ok = true;
+    for (int y = 0; y < pack.levels[0].height && ok; y++) {
+        // rows below the image repeat its last one
+        if (y < height && y % stripRows == 0) {
+            int rows = std::min(stripRows, height - y);
+            strip.resize(rows * rowBytes);
+            if (ppm) ok = fread(&strip[0], 1, strip.size(), ppm) == strip.size();
+            else memcpy(&strip[0], image + (size_t) y * rowBytes, strip.size());
+            if (!ok) printf("%s ends early.\n", source);
+        }
+        if (!ok) break;
+        const unsigned char* row = &strip[(size_t) ((std::min(y, height - 1)) % stripRows) * rowBytes];
+        for (size_t x = 0; x < padded.size(); x += rowBytes) memcpy(&padded[x], row, std::min(rowBytes, padded.size() - x));
+        ok = addPackRow(pack, 0, &padded[0]);
+    }
+    if (ppm) fclose(ppm);
+    if (image) SOIL_free_image_data(image);
+    // padding tiles past the last one written are holes too
+    size_t bytes = sizeof(VirtualTextureHeader) + tiles * pack.tileBytes;
+    ok = ok && fflush(pack.file) == 0 && ftruncate(fileno(pack.file), (off_t) bytes) == 0;
+    fclose(pack.file);
+    if (!ok) {
+        printf("Failed to write %s\n", path);
+        return false;
+    }
+    printf("Wrote %s: %dx%d texels in %dx%d tiles of %d texels, %d levels, %zu tiles, %.1f MiB\n", path, width, height,
+        header.tilesX, header.tilesY, content, header.levels, pack.tilesWritten, pack.tilesWritten * pack.tileBytes / 1048576.0);
+    return true;
+}
+
+struct VirtualTexture {
+    VirtualTextureHeader header;
+    int fd;
+    size_t fileSize;
+    const unsigned char* data;
+    int tileSize;
+    size_t tileBytes;
+    std::vector<size_t> levelOffset; // first tile of each level in the pack
+    int layer; // texture array layer the virtual texture replaces
+
+    GLuint atlas, indirection;
+    int atlasTiles; // per side
+    std::vector<long long> slotTile; // tile key held by each slot, -1 when free
+    std::vector<long> slotUsed; // frame the slot was last wanted
+    std::vector<bool> slotPinned;
+    std::map<long long, int> resident;
+    std::vector<std::vector<unsigned char> > table; // RGBA8 indirection texels: slot x, slot y, level
+    std::vector<bool> tableDirty;
+
+    GLuint feedbackFbo, feedbackColor, feedbackDepth;
+    int feedbackWidth, feedbackHeight;
+    GLuint feedbackPbo[2];
+    bool feedbackPending[2];
+    int feedbackSlot;
+    std::vector<long long> wanted, missing;
+
+    std::thread loader;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<long long> requests;
+    std::deque<std::pair<long long, std::vector<unsigned char> > > loaded;
+    std::vector<std::pair<long long, std::vector<unsigned char> > > ready; // loaded, waiting for an atlas slot
+    std::set<long long> inFlight; // requested, loading or ready
+    bool done;
+
+    long frame;
+    unsigned tilesLoaded, tilesEvicted;
+};
+
+long long tileKey(int level, int x, int y) {
+    return ((long long) level << 48) | ((long long) y << 24) | x;
+}
+
+int tileLevel(long long key) { return (int) (key >> 48); }
+int tileX(long long key) { return (int) (key & 0xFFFFFF); }
+int tileY(long long key) { return (int) ((key >> 24) & 0xFFFFFF); }
+
+int virtualTilesX(const VirtualTexture &vt, int level) { return vt.header.tilesX >> level; }
+int virtualTilesY(const VirtualTexture &vt, int level) { return vt.header.tilesY >> level; }
+
+// Points every indirection texel under tile `key`, at its own and finer levels,
+// that currently resolves to a level coarser than `minLevel` (or exactly
+// `minLevel` when evicting) at the given entry.
+void remapTileRegion(VirtualTexture &vt, long long key, const unsigned char* entry, bool evicting) {
+    int level = tileLevel(key);
+    for (int l = level; l >= 0; l--) {
+        int shift = level - l;
+        int w = virtualTilesX(vt, l);
+        for (int y = tileY(key) << shift; y < (tileY(key) + 1) << shift; y++) {
+            for (int x = tileX(key) << shift; x < (tileX(key) + 1) << shift; x++) {
+                unsigned char* texel = &vt.table[l][(y * w + x) * 4];
+                if (evicting ? texel[2] != level : texel[2] <= level && texel[3]) continue;
+                memcpy(texel, entry, 4);
+            }
+        }
+        vt.tableDirty[l] = true;
+    }
+}
+
+// Copies a tile out of the mapped pack, faulting its pages in.
+void readTile(const VirtualTexture &vt, long long key, std::vector<unsigned char> &texels) {
+    int level = tileLevel(key);
+    size_t index = vt.levelOffset[level] + (size_t) tileY(key) * virtualTilesX(vt, level) + tileX(key);
+    const unsigned char* src = vt.data + sizeof(VirtualTextureHeader) + index * vt.tileBytes;
+    texels.assign(src, src + vt.tileBytes);
+}
+
+void virtualTextureLoaderLoop(VirtualTexture* vt) {
+    while (true) {
+        long long key;
+        {
+            std::unique_lock<std::mutex> lock(vt->mutex);
+            while (vt->requests.empty() && !vt->done) vt->wake.wait(lock);
+            if (vt->done) return;
+            key = vt->requests.front();
+            vt->requests.pop_front();
+        }
+        std::vector<unsigned char> texels;
+        readTile(*vt, key, texels);
+        std::lock_guard<std::mutex> lock(vt->mutex);
+        vt->loaded.push_back(std::make_pair(key, std::vector<unsigned char>()));
+        vt->loaded.back().second.swap(texels);
+    }
+}
+
+void loadTile(VirtualTexture &vt, long long key, int slot, const unsigned char* texels) {
+    int level = tileLevel(key);
+    int sx = slot % vt.atlasTiles, sy = slot / vt.atlasTiles;
+    GLCALL(glTexSubImage2D(GL_TEXTURE_2D, 0, sx * vt.tileSize, sy * vt.tileSize, vt.tileSize, vt.tileSize,
+        GL_RGB, GL_UNSIGNED_BYTE, texels));
+    frameStats.bytesUploaded += vt.tileBytes;
+
+    vt.slotTile[slot] = key;
+    vt.slotUsed[slot] = vt.frame;
+    vt.resident[key] = slot;
+    unsigned char entry[4] = { (unsigned char) sx, (unsigned char) sy, (unsigned char) level, 255 };
+    remapTileRegion(vt, key, entry, false);
+    vt.tilesLoaded++;
+}
+
+// Frees the slot's tile; texels that showed it fall back to its parent's mapping.
+void evictTile(VirtualTexture &vt, int slot) {
+    long long key = vt.slotTile[slot];
+    int level = tileLevel(key);
+    const unsigned char* parent = &vt.table[level + 1][((tileY(key) >> 1) * virtualTilesX(vt, level + 1) + (tileX(key) >> 1)) * 4];
+    unsigned char entry[4];
+    memcpy(entry, parent, 4);
+    remapTileRegion(vt, key, entry, true);
+    vt.resident.erase(key);
+    vt.slotTile[slot] = -1;
+    vt.tilesEvicted++;
+}
+
+bool openVirtualTexture(VirtualTexture &vt, const char* path, int atlasTiles, int layer, int feedbackWidth, int feedbackHeight) {
+    vt.fd = open(path, O_RDONLY);
+    struct stat info;
+    if (vt.fd < 0 || fstat(vt.fd, &info) != 0) {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
+    vt.fileSize = info.st_size;
+    void* mapped = mmap(NULL, vt.fileSize, PROT_READ, MAP_SHARED, vt.fd, 0);
+    if (mapped == MAP_FAILED || vt.fileSize < sizeof(VirtualTextureHeader)) {
+        printf("Failed to map %s\n", path);
+        close(vt.fd);
+        return false;
+    }
+    vt.data = (const unsigned char*) mapped;
+    memcpy(&vt.header, vt.data, sizeof(vt.header));
+    vt.tileSize = vt.header.content + 2 * vt.header.border;
+    vt.tileBytes = (size_t) vt.tileSize * vt.tileSize * 3;
+    size_t tiles = 0;
+    for (int l = 0; l < vt.header.levels; l++) {
+        vt.levelOffset.push_back(tiles);
+        tiles += (size_t) virtualTilesX(vt, l) * virtualTilesY(vt, l);
+    }
+    if (memcmp(vt.header.magic, "VTX2", 4) != 0 || vt.fileSize < sizeof(VirtualTextureHeader) + tiles * vt.tileBytes) {
+        printf("%s is not a virtual texture pack.\n", path);
+        munmap(mapped, vt.fileSize);
+        close(vt.fd);
+        return false;
+    }
+    vt.layer = layer;
+    vt.atlasTiles = atlasTiles;
+    vt.slotTile.assign(atlasTiles * atlasTiles, -1);
+    vt.slotUsed.assign(atlasTiles * atlasTiles, -1);
+    vt.slotPinned.assign(atlasTiles * atlasTiles, false);
+    vt.frame = 0;
+    vt.tilesLoaded = 0;
+    vt.tilesEvicted = 0;
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glGenTextures(1, &vt.atlas);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, vt.atlas);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, atlasTiles * vt.tileSize, atlasTiles * vt.tileSize, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    vt.table.resize(vt.header.levels);
+    vt.tableDirty.assign(vt.header.levels, true);
+    for (int l = 0; l < vt.header.levels; l++) vt.table[l].assign(virtualTilesX(vt, l) * virtualTilesY(vt, l) * 4, 0);
+    int top = vt.header.levels - 1;
+    if (virtualTilesX(vt, top) * virtualTilesY(vt, top) > atlasTiles * atlasTiles) {
+        printf("Virtual texture atlas too small for the top level.\n");
+        glDeleteTextures(1, &vt.atlas);
+        munmap(mapped, vt.fileSize);
+        close(vt.fd);
+        return false;
+    }
+    glGenTextures(1, &vt.indirection);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, vt.indirection);
+    for (int l = 0; l < vt.header.levels; l++) {
+        glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA8, virtualTilesX(vt, l), virtualTilesY(vt, l), 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, top);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glActiveTexture(GL_TEXTURE1);
+    std::vector<unsigned char> texels;
+    for (int y = 0; y < virtualTilesY(vt, top); y++) {
+        for (int x = 0; x < virtualTilesX(vt, top); x++) {
+            int slot = y * virtualTilesX(vt, top) + x;
+            readTile(vt, tileKey(top, x, y), texels);
+            loadTile(vt, tileKey(top, x, y), slot, &texels[0]);
+            vt.slotPinned[slot] = true;
+        }
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    vt.feedbackWidth = feedbackWidth;
+    vt.feedbackHeight = feedbackHeight;
+    glGenFramebuffers(1, &vt.feedbackFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, vt.feedbackFbo);
+    glGenRenderbuffers(1, &vt.feedbackColor);
+    glBindRenderbuffer(GL_RENDERBUFFER, vt.feedbackColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA16UI, feedbackWidth, feedbackHeight);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, vt.feedbackColor);
+    glGenRenderbuffers(1, &vt.feedbackDepth);
+    glBindRenderbuffer(GL_RENDERBUFFER, vt.feedbackDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, feedbackWidth, feedbackHeight);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, vt.feedbackDepth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Feedback framebuffer is incomplete.\n");
+    }
+    glGenBuffers(2, vt.feedbackPbo);
+    for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, vt.feedbackPbo[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, feedbackWidth * feedbackHeight * 4 * sizeof(GLushort), NULL, GL_STREAM_READ);
+        vt.feedbackPending[i] = false;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    vt.feedbackSlot = 0;
+    vt.done = false;
+    vt.loader = std::thread(virtualTextureLoaderLoop, &vt);
+    return true;
+}
+
+// Reads back this frame's feedback, consumes last frame's, queues up to
+// `budget` missing tiles on the loader, coarsest first, and uploads up to
+// `budget` tiles it has finished. Call with the feedback framebuffer bound.
+void updateVirtualTexture(VirtualTexture &vt, int budget) {
+    vt.frame++;
+    int slot = vt.feedbackSlot;
+    vt.feedbackSlot = 1 - slot;
+    GLCALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, vt.feedbackPbo[slot]));
+    GLCALL(glReadPixels(0, 0, vt.feedbackWidth, vt.feedbackHeight, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, 0));
+    vt.feedbackPending[slot] = true;
+
+    int previous = 1 - slot;
+    vt.wanted.clear();
+    if (vt.feedbackPending[previous]) {
+        size_t count = (size_t) vt.feedbackWidth * vt.feedbackHeight;
+        GLCALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, vt.feedbackPbo[previous]));
+        const GLushort* pixels = (const GLushort*) GLCALL(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, count * 4 * sizeof(GLushort), GL_MAP_READ_BIT));
+        if (pixels) {
+            for (size_t i = 0; i < count; i++) {
+                const GLushort* p = pixels + i * 4;
+                if (p[3]) vt.wanted.push_back(tileKey(p[2], p[0], p[1]));
+            }
+            GLCALL(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+        }
+        vt.feedbackPending[previous] = false;
+    }
+    GLCALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+    std::sort(vt.wanted.begin(), vt.wanted.end());
+    vt.wanted.erase(std::unique(vt.wanted.begin(), vt.wanted.end()), vt.wanted.end());
+
+    // touch wanted tiles and the resident ancestors standing in for them
+    vt.missing.clear();
+    for (size_t i = 0; i < vt.wanted.size(); i++) {
+        long long key = vt.wanted[i];
+        if (tileLevel(key) >= vt.header.levels) continue;
+        if (!vt.resident.count(key)) vt.missing.push_back(key);
+        for (int level = tileLevel(key), x = tileX(key), y = tileY(key); level < vt.header.levels; level++, x >>= 1, y >>= 1) {
+            std::map<long long, int>::iterator it = vt.resident.find(tileKey(level, x, y));
+            if (it != vt.resident.end()) vt.slotUsed[it->second] = vt.frame;
+        }
+    }
+    std::sort(vt.missing.begin(), vt.missing.end(), std::greater<long long>());
+
+    {
+        // requests the loader hasn't started are stale; replace them with this frame's
+        std::lock_guard<std::mutex> lock(vt.mutex);
+        for (size_t i = 0; i < vt.requests.size(); i++) vt.inFlight.erase(vt.requests[i]);
+        vt.requests.clear();
+        for (size_t i = 0; i < vt.missing.size() && (int) vt.requests.size() < budget; i++) {
+            if (vt.inFlight.insert(vt.missing[i]).second) vt.requests.push_back(vt.missing[i]);
+        }
+        if (!vt.requests.empty()) vt.wake.notify_one();
+        while (!vt.loaded.empty()) {
+            vt.ready.push_back(std::make_pair(vt.loaded.front().first, std::vector<unsigned char>()));
+            vt.ready.back().second.swap(vt.loaded.front().second);
+            vt.loaded.pop_front();
+        }
+    }
+    std::sort(vt.ready.begin(), vt.ready.end(), std::greater<std::pair<long long, std::vector<unsigned char> > >());
+
+    bindTexture(GL_TEXTURE1, GL_TEXTURE_2D, vt.atlas);
+    size_t uploaded = 0;
+    for (; uploaded < vt.ready.size() && (int) uploaded < budget; uploaded++) {
+        int victim = -1;
+        for (size_t s = 0; s < vt.slotTile.size(); s++) {
+            if (vt.slotPinned[s] || vt.slotUsed[s] == vt.frame) continue;
+            if (victim < 0 || vt.slotUsed[s] < vt.slotUsed[victim]) victim = (int) s;
+        }
+        if (victim < 0) break; // everything in the atlas is on screen
+        if (vt.slotTile[victim] >= 0) evictTile(vt, victim);
+        loadTile(vt, vt.ready[uploaded].first, victim, &vt.ready[uploaded].second[0]);
+        vt.inFlight.erase(vt.ready[uploaded].first);
+    }
+    vt.ready.erase(vt.ready.begin(), vt.ready.begin() + uploaded);
+
+    bindTexture(GL_TEXTURE2, GL_TEXTURE_2D, vt.indirection);
+    for (int l = 0; l < vt.header.levels; l++) {
+        if (!vt.tableDirty[l]) continue;
+        GLCALL(glTexSubImage2D(GL_TEXTURE_2D, l, 0, 0, virtualTilesX(vt, l), virtualTilesY(vt, l), GL_RGBA, GL_UNSIGNED_BYTE, &vt.table[l][0]));
+        frameStats.bytesUploaded += vt.table[l].size();
+        vt.tableDirty[l] = false;
+    }
+}
+
+void deleteVirtualTexture(VirtualTexture &vt) {
+    {
+        std::lock_guard<std::mutex> lock(vt.mutex);
+        vt.done = true;
+        vt.wake.notify_one();
+    }
+    vt.loader.join();
+    glDeleteBuffers(2, vt.feedbackPbo);
+    glDeleteRenderbuffers(1, &vt.feedbackDepth);
+    glDeleteRenderbuffers(1, &vt.feedbackColor);
+    glDeleteFramebuffers(1, &vt.feedbackFbo);
+    glDeleteTextures(1, &vt.indirection);
+    glDeleteTextures(1, &vt.atlas);
+    munmap((void*) vt.data, vt.fileSize);
+    close(vt.fd);
+}
+
+struct Globe {
+    std::vector<float> vertices; // x, y, z, tex x, tex y
+    std::vector<float> normals; // x, y, z
+    std::vector<GLuint> indices;
+    int res;
+    float radius;
+};
+
+// Vertex as stored in the arena, 16 bytes instead of the 20 of five floats
+// and with a normal on top. Positions are snorm16 divided by the mesh's
+// largest coordinate, so a globe holds the unit sphere and the vertex shader
+// scales it by the instance radius. The normal is 10:10:10:2 snorm, or
+// snorm8 where the driver cannot fetch that, and texcoords are unorm16.
+struct PackedVertex {
+    glm::uint64 position; // x, y, z, unused
+    glm::uint32 normal;
+    glm::uint32 texcoord;
+};
+
+// The unquantized layout, kept for comparison.
+struct FloatVertex {
+    float position[3];
+    float normal[3];
+    float texcoord[2];
+};
+
+// How the arena stores vertices. VERTEX_UV keeps only the unorm16 texcoord,
+// 4 bytes, and the vertex shader rebuilds the point on the unit sphere from
+// it, so it only holds meshes from makeGlobe and makeQuad.
+enum VertexFormat {
+    VERTEX_FLOAT,
+    VERTEX_PACKED,
+    VERTEX_UV
+};
+
+const char* vertexFormatNames[] = { "float", "packed", "uv" };
+
+size_t vertexSize(VertexFormat format) {
+    switch (format) {
+    case VERTEX_FLOAT: return sizeof(FloatVertex);
+    case VERTEX_PACKED: return sizeof(PackedVertex);
+    default: return sizeof(glm::uint32);
+    }
+}
+
+// A vertex shader drawing from an arena of the given format. Its mesh inputs
+// are spliced in right after the #version line.
+GLuint makeMeshShader(const GLchar* source, VertexFormat format) {
+    const GLchar* body = strchr(strstr(source, "#version"), '\n') + 1;
+    const GLchar* sources[] = { source, format == VERTEX_UV ? meshUvInputsSource : meshInputsSource, body };
+    GLint lengths[] = { (GLint) (body - source), -1, -1 };
+    return compileShader(GL_VERTEX_SHADER, 3, sources, lengths);
+}
+
+// What the old six-vertices-per-quad soup pushed through the vertex shader.
+size_t soupVertexCount(int res) {
+    return 6 * 2 * (size_t) res * res;
+}
+
+// Rough post-transform cache model: a FIFO of recently shaded vertices. Good
+// enough to compare triangle orders; real hardware varies.
+size_t countVertexInvocations(const std::vector<GLuint> &indices, size_t cacheSize) {
+    std::vector<GLuint> fifo;
+    size_t misses = 0;
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (std::find(fifo.begin(), fifo.end(), indices[i]) != fifo.end()) continue;
+        misses++;
+        fifo.push_back(indices[i]);
+        if (fifo.size() > cacheSize) fifo.erase(fifo.begin());
+    }
+    return misses;
+}
+
+// Tom Forsyth's linear-speed vertex cache optimisation: greedily emit the
+// triangle whose vertices score best against a simulated LRU cache.
+float forsythScore(int cachePos, int remaining) {
+    const int cacheSize = 32;
+    if (remaining == 0) return -1.0f;
+    float score = 0.0f;
+    if (cachePos >= 0) {
+        if (cachePos < 3) score = 0.75f;
+        else score = pow(1.0f - (cachePos - 3) * (1.0f / (cacheSize - 3)), 1.5f);
+    }
+    return score + 2.0f * pow((float) remaining, -0.5f);
+}
+
+void optimizeVertexCache(std::vector<GLuint> &indices, size_t vertexCount) {
+    const int cacheSize = 32;
+    size_t triCount = indices.size() / 3;
+    std::vector<int> remaining(vertexCount, 0);
+    std::vector<int> cachePos(vertexCount, -1);
+    std::vector<float> score(vertexCount);
+    std::vector<std::vector<size_t> > vertTris(vertexCount);
+    for (size_t t = 0; t < triCount; t++) {
+        for (int k = 0; k < 3; k++) {
+            remaining[indices[3 * t + k]]++;
+            vertTris[indices[3 * t + k]].push_back(t);
+        }
+    }
+    for (size_t v = 0; v < vertexCount; v++) score[v] = forsythScore(-1, remaining[v]);
+
+    std::vector<bool> emitted(triCount, false);
+    std::vector<float> triScore(triCount);
+    for (size_t t = 0; t < triCount; t++) {
+        triScore[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+    }
+
+    std::vector<GLuint> out;
+    out.reserve(indices.size());
+    std::vector<GLuint> cache;
+    size_t scan = 0;
+    long best = -1;
+    while (out.size() < indices.size()) {
+        if (best < 0) {
+            // nothing in the cache touches an open triangle, restart from the lowest unused one
+            while (emitted[scan]) scan++;
+            best = scan;
+        }
+        emitted[best] = true;
+        std::vector<GLuint> newCache;
+        for (int k = 0; k < 3; k++) {
+            GLuint v = indices[3 * best + k];
+            out.push_back(v);
+            remaining[v]--;
+            newCache.push_back(v);
+        }
+        for (size_t i = 0; i < cache.size(); i++) {
+            if (std::find(newCache.begin(), newCache.end(), cache[i]) == newCache.end()) newCache.push_back(cache[i]);
+        }
+        for (size_t i = 0; i < newCache.size(); i++) {
+            GLuint v = newCache[i];
+            cachePos[v] = i < (size_t) cacheSize ? (int) i : -1;
+            score[v] = forsythScore(cachePos[v], remaining[v]);
+        }
+        if (newCache.size() > (size_t) cacheSize) newCache.resize(cacheSize);
+        cache.swap(newCache);
+
+        best = -1;
+        float bestScore = -1.0f;
+        for (size_t i = 0; i < cache.size(); i++) {
+            const std::vector<size_t> &tris = vertTris[cache[i]];
+            for (size_t j = 0; j < tris.size(); j++) {
+                size_t t = tris[j];
+                if (emitted[t]) continue;
+                triScore[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] + score[indices[3 * t + 2]];
+                if (triScore[t] > bestScore) {
+                    bestScore = triScore[t];
+                    best = t;
+                }
+            }
+        }
+    }
+    indices.swap(out);
+}
+
+// Shared (res + 1) x (2 * res + 1) lat/long grid. The seam column is doubled so
+// the texture wraps, and the pole triangles that collapse to a line are dropped.
+Globe makeGlobe(float d, int res, bool optimize) {
+    Globe globe;
+    globe.res = res;
+    globe.radius = d;
+    float pi = 3.1415926;
+    int cols = 2 * res + 1;
+    std::vector<float> cosu(cols), sinu(cols);
+    for (int j = 0; j < cols; j++) {
+        float u = j * pi / res;
+        cosu[j] = cos(u);
+        sinu[j] = sin(u);
+    }
+    globe.vertices.reserve(5 * cols * (res + 1));
+    globe.normals.reserve(3 * cols * (res + 1));
+    for (int i = 0; i <= res; i++) {
+        float v = i * pi / res;
+        float sinv = sin(v);
+        float cosv = cos(v);
+        for (int j = 0; j < cols; j++) {
+            globe.vertices.push_back(d * cosu[j] * sinv); // x
+            globe.vertices.push_back(d * sinu[j] * sinv); // y
+            globe.vertices.push_back(d * cosv); // z
+            globe.vertices.push_back((float) j / (2 * res)); // tex x
+            globe.vertices.push_back((float) i / res); // tex y
+            globe.normals.push_back(cosu[j] * sinv);
+            globe.normals.push_back(sinu[j] * sinv);
+            globe.normals.push_back(cosv);
+        }
+    }
+    globe.indices.reserve(6 * 2 * res * res);
+    for (int i = 0; i < res; i++) {
+        for (int j = 0; j < 2 * res; j++) {
+            GLuint a = i * cols + j;
+            GLuint b = a + 1;
+            GLuint c = a + cols;
+            GLuint e = c + 1;
+            if (i != 0) {
+                globe.indices.push_back(a);
+                globe.indices.push_back(b);
+                globe.indices.push_back(c);
+            }
+            if (i != res - 1) {
+                globe.indices.push_back(b);
+                globe.indices.push_back(c);
+                globe.indices.push_back(e);
+            }
+        }
+    }
+    if (optimize) optimizeVertexCache(globe.indices, globe.vertices.size() / 5);
+    return globe;
+}
+
+// Unit quad in the xy plane, the corners impostors are expanded from.
+Globe makeQuad() {
+    Globe quad;
+    quad.res = 0;
+    quad.radius = sqrt(2.0f);
+    const float corners[] = { -1.0f, -1.0f, 1.0f, -1.0f, 1.0f, 1.0f, -1.0f, 1.0f };
+    for (int i = 0; i < 4; i++) {
+        quad.vertices.push_back(corners[2 * i]);
+        quad.vertices.push_back(corners[2 * i + 1]);
+        quad.vertices.push_back(0.0f);
+        quad.vertices.push_back(corners[2 * i] * 0.5f + 0.5f);
+        quad.vertices.push_back(corners[2 * i + 1] * 0.5f + 0.5f);
+        quad.normals.push_back(0.0f);
+        quad.normals.push_back(0.0f);
+        quad.normals.push_back(1.0f);
+    }
+    const GLuint indices[] = { 0, 1, 2, 0, 2, 3 };
+    quad.indices.assign(indices, indices + 6);
+    return quad;
+}
+
+void reportGlobe(const char* name, const Globe &globe, size_t bytesPerVertex) {
+    size_t soupVertices = soupVertexCount(globe.res);
+    printf("%s: %zu vertices (%zu bytes, was %zu), %zu indices, vertex shader runs per draw: %zu indexed (cache estimate) vs %zu unindexed (%zu with the old float-count draw)\n",
+        name, globe.vertices.size() / 5, globe.vertices.size() / 5 * bytesPerVertex, soupVertices * 5 * sizeof(float),
+        globe.indices.size(), countVertexInvocations(globe.indices, 32), soupVertices, soupVertices * 5);
+}
+
+// Where one mesh lives inside the shared arena buffers.
+struct MeshRange {
+    GLint baseVertex;
+    size_t firstIndex;
+    GLsizei indexCount;
+    float radius; // bounding sphere around the mesh origin
+};
+
+// Every mesh shares one vertex buffer, one index buffer and one VAO; meshes
+// are addressed through the base-vertex/offset table. With ARB_buffer_storage
+// both buffers stay persistently mapped so meshes can be appended at any time.
+struct MeshArena {
+    GLuint vao, vbo, ebo;
+    GLenum indexType;
+    size_t indexSize;
+    VertexFormat format;
+    size_t vertexSize;
+    GLenum normalType; // GL_INT_2_10_10_10_REV or GL_BYTE
+    size_t vertexCapacity, indexCapacity;
+    size_t vertexCount, indexCount;
+    bool persistent;
+    char* mappedVertices;
+    char* mappedIndices;
+    std::vector<MeshRange> meshes;
+};
+
+void allocArenaBuffer(MeshArena &arena, GLenum target, GLuint buffer, size_t bytes, char** mapped) {
+    glBindBuffer(target, buffer);
+    if (arena.persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(target, bytes, NULL, flags);
+        *mapped = (char*) glMapBufferRange(target, 0, bytes, flags);
+    }
+    else {
+        glBufferData(target, bytes, NULL, GL_STATIC_DRAW);
+        *mapped = NULL;
+    }
+}
+
+// Attribute locations are fixed for every program drawing from the arena.
+const GLuint posLocation = 0;
+const GLuint texLocation = 1;
+const GLuint normalLocation = 9;
+
+MeshArena makeMeshArena(size_t vertexCapacity, size_t indexCapacity, GLenum indexType, VertexFormat format) {
+    MeshArena arena;
+    arena.indexType = indexType;
+    arena.indexSize = indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+    arena.format = format;
+    arena.vertexSize = vertexSize(format);
+    arena.vertexCapacity = vertexCapacity;
+    arena.indexCapacity = indexCapacity;
+    arena.vertexCount = 0;
+    arena.indexCount = 0;
+    arena.persistent = GLEW_ARB_buffer_storage != 0;
+    // 10:10:10:2 vertex fetch is core only from GL 3.3
+    arena.normalType = GLEW_ARB_vertex_type_2_10_10_10_rev ? GL_INT_2_10_10_10_REV : GL_BYTE;
+
+    glGenVertexArrays(1, &arena.vao);
+    glBindVertexArray(arena.vao);
+    glGenBuffers(1, &arena.vbo);
+    glGenBuffers(1, &arena.ebo);
+    allocArenaBuffer(arena, GL_ARRAY_BUFFER, arena.vbo, vertexCapacity * arena.vertexSize, &arena.mappedVertices);
+    allocArenaBuffer(arena, GL_ELEMENT_ARRAY_BUFFER, arena.ebo, indexCapacity * arena.indexSize, &arena.mappedIndices);
+
+    GLsizei stride = (GLsizei) arena.vertexSize;
+    glEnableVertexAttribArray(texLocation);
+    if (format == VERTEX_FLOAT) {
+        glEnableVertexAttribArray(posLocation);
+        glVertexAttribPointer(posLocation, 3, GL_FLOAT, GL_FALSE, stride, (char*) offsetof(FloatVertex, position));
+        glEnableVertexAttribArray(normalLocation);
+        glVertexAttribPointer(normalLocation, 3, GL_FLOAT, GL_FALSE, stride, (char*) offsetof(FloatVertex, normal));
+        glVertexAttribPointer(texLocation, 2, GL_FLOAT, GL_FALSE, stride, (char*) offsetof(FloatVertex, texcoord));
+    }
+    else if (format == VERTEX_PACKED) {
+        glEnableVertexAttribArray(posLocation);
+        glVertexAttribPointer(posLocation, 3, GL_SHORT, GL_TRUE, stride, (char*) offsetof(PackedVertex, position));
+        glEnableVertexAttribArray(normalLocation);
+        glVertexAttribPointer(normalLocation, arena.normalType == GL_BYTE ? 3 : 4, arena.normalType, GL_TRUE, stride,
+            (char*) offsetof(PackedVertex, normal));
+        glVertexAttribPointer(texLocation, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, (char*) offsetof(PackedVertex, texcoord));
+    }
+    else {
+        glVertexAttribPointer(texLocation, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, 0);
+    }
+    return arena;
+}
+
+// Copies a globe into the arena and returns its mesh id, or -1 when it does not fit.
+int addMesh(MeshArena &arena, const Globe &globe) {
+    size_t vertices = globe.vertices.size() / 5;
+    size_t indices = globe.indices.size();
+    if (arena.vertexCount + vertices > arena.vertexCapacity || arena.indexCount + indices > arena.indexCapacity) {
+        printf("Mesh arena full.\n");
+        return -1;
+    }
+    if (arena.indexType == GL_UNSIGNED_SHORT && vertices > 65536) {
+        printf("Mesh has too many vertices for 16-bit indices.\n");
+        return -1;
+    }
+
+    std::vector<char> indexData(indices * arena.indexSize);
+    for (size_t i = 0; i < indices; i++) {
+        if (arena.indexType == GL_UNSIGNED_SHORT) ((GLushort*) &indexData[0])[i] = (GLushort) globe.indices[i];
+        else ((GLuint*) &indexData[0])[i] = globe.indices[i];
+    }
+    float scale = 0.0f;
+    for (size_t i = 0; i < vertices; i++) {
+        for (int c = 0; c < 3; c++) scale = std::max(scale, fabsf(globe.vertices[5 * i + c]));
+    }
+    std::vector<char> vertexData(vertices * arena.vertexSize);
+    for (size_t i = 0; i < vertices; i++) {
+        const float* v = &globe.vertices[5 * i];
+        glm::vec3 position = glm::vec3(v[0], v[1], v[2]) / scale;
+        glm::vec3 normal(globe.normals[3 * i], globe.normals[3 * i + 1], globe.normals[3 * i + 2]);
+        if (arena.format == VERTEX_FLOAT) {
+            FloatVertex &out = ((FloatVertex*) &vertexData[0])[i];
+            memcpy(out.position, glm::value_ptr(position), sizeof(out.position));
+            memcpy(out.normal, glm::value_ptr(normal), sizeof(out.normal));
+            out.texcoord[0] = v[3];
+            out.texcoord[1] = v[4];
+        }
+        else if (arena.format == VERTEX_PACKED) {
+            PackedVertex &out = ((PackedVertex*) &vertexData[0])[i];
+            out.position = glm::packSnorm4x16(glm::vec4(position, 0.0f));
+            out.normal = arena.normalType == GL_BYTE ? glm::packSnorm4x8(glm::vec4(normal, 0.0f))
+                : glm::packSnorm3x10_1x2(glm::vec4(normal, 0.0f));
+            out.texcoord = glm::packUnorm2x16(glm::vec2(v[3], v[4]));
+        }
+        else {
+            ((glm::uint32*) &vertexData[0])[i] = glm::packUnorm2x16(glm::vec2(v[3], v[4]));
+        }
+    }
+    size_t vertexOffset = arena.vertexCount * arena.vertexSize;
+    size_t indexOffset = arena.indexCount * arena.indexSize;
+    if (arena.persistent) {
+        memcpy(arena.mappedVertices + vertexOffset, &vertexData[0], vertexData.size());
+        memcpy(arena.mappedIndices + indexOffset, &indexData[0], indexData.size());
+    }
+    else {
+        glBindVertexArray(arena.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, arena.vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, vertexOffset, vertexData.size(), &vertexData[0]);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indexOffset, indexData.size(), &indexData[0]);
+    }
+
+    MeshRange range;
+    range.baseVertex = (GLint) arena.vertexCount;
+    range.firstIndex = arena.indexCount;
+    range.indexCount = (GLsizei) indices;
+    range.radius = globe.radius;
+    arena.meshes.push_back(range);
+    arena.vertexCount += vertices;
+    arena.indexCount += indices;
+    return (int) arena.meshes.size() - 1;
+}
+
+// Assumes the arena VAO is bound.
+void drawMesh(const MeshArena &arena, int mesh) {
+    const MeshRange &range = arena.meshes[mesh];
+    frameStats.draws++;
+    GLCALL(glDrawElementsBaseVertex(GL_TRIANGLES, range.indexCount, arena.indexType,
+        (char*)(range.firstIndex * arena.indexSize), range.baseVertex));
+}
+
+void deleteMeshArena(MeshArena &arena) {
+    if (arena.persistent) {
+        glBindVertexArray(arena.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, arena.vbo);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+        glBindVertexArray(0);
+    }
+    glDeleteBuffers(1, &arena.ebo);
+    glDeleteBuffers(1, &arena.vbo);
+    glDeleteVertexArrays(1, &arena.vao);
+}
+
+// Per-instance attributes, streamed into the instance buffer every frame.
+struct InstanceData {
+    glm::mat4 model;
+    float layer;
+    float radius;
+    float fade; // dithered coverage while cross-fading LOD levels, see selectLod
+};
+
+const GLuint modelLocation = 2; // a mat4 takes locations 2 to 5
+const GLuint layerLocation = 6;
+const GLuint radiusLocation = 7;
+const GLuint fadeLocation = 8;
+
+// Points the instance attributes of the arena VAO at byte offset `offset` of
+// the instance buffer. Without ARB_base_instance this is how a draw selects
+// its slice of the buffer.
+void pointInstanceAttribs(GLuint instanceVbo, size_t offset) {
+    bindArrayBuffer(instanceVbo);
+    for (int i = 0; i < 4; i++) {
+        GLCALL(glVertexAttribPointer(modelLocation + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+            (char*)(offset + i * sizeof(glm::vec4))));
+    }
+    GLCALL(glVertexAttribPointer(layerLocation, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+        (char*)(offset + offsetof(InstanceData, layer))));
+    GLCALL(glVertexAttribPointer(radiusLocation, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+        (char*)(offset + offsetof(InstanceData, radius))));
+    GLCALL(glVertexAttribPointer(fadeLocation, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+        (char*)(offset + offsetof(InstanceData, fade))));
+}
+
+void attachInstanceBuffer(const MeshArena &arena, GLuint instanceVbo) {
+    glBindVertexArray(arena.vao);
+    for (int i = 0; i < 4; i++) {
+        glEnableVertexAttribArray(modelLocation + i);
+        glVertexAttribDivisor(modelLocation + i, 1);
+    }
+    glEnableVertexAttribArray(layerLocation);
+    glVertexAttribDivisor(layerLocation, 1);
+    glEnableVertexAttribArray(radiusLocation);
+    glVertexAttribDivisor(radiusLocation, 1);
+    glEnableVertexAttribArray(fadeLocation);
+    glVertexAttribDivisor(fadeLocation, 1);
+    pointInstanceAttribs(instanceVbo, 0);
+}
+
+// Orphans the instance buffer and streams this frame's instances into it.
+void uploadInstances(GLuint instanceVbo, size_t &capacity, const std::vector<InstanceData> &instances) {
+    size_t bytes = instances.size() * sizeof(InstanceData);
+    if (bytes == 0) return;
+    frameStats.bytesUploaded += bytes;
+    bindArrayBuffer(instanceVbo);
+    if (bytes > capacity) capacity = bytes * 2;
+    GLCALL(glBufferData(GL_ARRAY_BUFFER, capacity, NULL, GL_STREAM_DRAW));
+    GLCALL(glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, &instances[0]));
+}
+
+// Draws instances [first, first + count) of the instance buffer with one mesh.
+// Assumes the arena VAO is bound.
+void drawMeshInstanced(const MeshArena &arena, int mesh, GLuint instanceVbo, size_t first, size_t count) {
+    const MeshRange &range = arena.meshes[mesh];
+    char* indices = (char*)(range.firstIndex * arena.indexSize);
+    frameStats.draws++;
+    if (GLEW_ARB_base_instance) {
+        GLCALL(glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, range.indexCount, arena.indexType,
+            indices, (GLsizei) count, range.baseVertex, (GLuint) first));
+        return;
+    }
+    pointInstanceAttribs(instanceVbo, first * sizeof(InstanceData));
+    GLCALL(glDrawElementsInstancedBaseVertex(GL_TRIANGLES, range.indexCount, arena.indexType,
+        indices, (GLsizei) count, range.baseVertex));
+}
+
+// A globe in the scene. Its model matrix is rotate(angle) * translate(position),
+// so a body placed away from the origin orbits it while one at the origin spins.
+struct Body {
+    int program; // index into the programs drawn by the main loop
+    int globe; // index into the LOD chains
+    float layer;
+    glm::vec3 position;
+    float angle;
+    float rate; // degrees per animation tick
+    float prevAngle; // angle before the last tick, rendering blends between the two
+};
+
+// Arena meshes of one globe at increasing resolution; level i has
+// baseRes * 2^i segments per half turn.
+struct LodChain {
+    std::vector<int> levels;
+    int baseRes;
+    float radius;
+};
+
+// Levels whose globes, (2 res + 1) * (res + 1) vertices, fit 16-bit indices.
+int maxLodLevels(int baseRes) {
+    int levels = 0;
+    for (long res = baseRes; (2 * res + 1) * (res + 1) <= 65536; res *= 2) levels++;
+    return levels;
+}
+
+// A level the arena cannot hold ends the chain there; selectLod only ever
+// picks from the levels that made it in.
+LodChain makeLodChain(MeshArena &arena, const char* name, float d, int baseRes, int levelCount, bool optimize) {
+    LodChain chain;
+    chain.baseRes = baseRes;
+    chain.radius = d;
+    for (int i = 0; i < levelCount; i++) {
+        Globe globe = makeGlobe(d, baseRes << i, optimize);
+        char label[64];
+        snprintf(label, sizeof(label), "%s LOD %d", name, i);
+        reportGlobe(label, globe, arena.vertexSize);
+        int mesh = addMesh(arena, globe);
+        if (mesh < 0) {
+            printf("%s stops at %d LOD levels.\n", name, i);
+            break;
+        }
+        chain.levels.push_back(mesh);
+    }
+    return chain;
+}
+
+// How levels are chosen: the coarsest level whose segments span at most
+// edgePx pixels on screen, cross-faded over the last fadeBand (in levels)
+// before the switch so the change dissolves instead of popping.
+struct LodSettings {
+    float edgePx;
+    float fadeBand;
+};
+
+// Level selection in log2 space: l is the fractional level needed for the
+// projected radius, the body draws ceil(l) and, within fadeBand of the next
+// integer, also the level above with a complementary dither mask. The band is
+// measured before clamping, so bodies too small for level 0 stay on it, and
+// at the band's edge the finer level takes over alone: two instances at full
+// coverage would z-fight.
+void selectLod(const LodChain &chain, const LodSettings &lod, float radiusPx, int &level, float &fineCoverage) {
+    int top = (int) chain.levels.size() - 1;
+    float pi = 3.1415926;
+    float wanted = log2(std::max(radiusPx * pi / (lod.edgePx * chain.baseRes), 1e-6f));
+    float l = std::min(std::max(wanted, 0.0f), (float) top);
+    level = (int) ceil(l);
+    fineCoverage = 0.0f;
+    if (level < top && lod.fadeBand > 0.0f && level - wanted < lod.fadeBand) {
+        fineCoverage = 1.0f - (level - wanted) / lod.fadeBand;
+        if (fineCoverage >= 1.0f) {
+            level++;
+            fineCoverage = 0.0f;
+        }
+    }
+}
+
+// One instanced draw: `count` instances starting at `first` in the instance buffer.
+struct DrawBatch {
+    unsigned long long key; // see makeSortKey
+    int program;
+    int mesh;
+    size_t first;
+    size_t count;
+};
+
+// Where a program's draws go in the frame and what they sample.
+struct DrawTraits {
+    int pass; // render pass drawing it, in submission order
+    int textureSet; // 0 when the program samples no textures
+};
+
+// Sort key, most significant field first: pass (4 bits), program (8),
+// texture set (8), vertex array (8), depth (16), mesh (20). Sorting the keys
+// groups draws by their most expensive state and, within the same state,
+// front to back so early depth testing rejects more. The depth field is the
+// upper half of the float's bit pattern, which orders non-negative floats
+// without needing the depth range.
+unsigned long long makeSortKey(int pass, int program, int textureSet, int vao, float depth, int mesh) {
+    depth = std::max(depth, 0.0f);
+    unsigned depthBits;
+    memcpy(&depthBits, &depth, sizeof(depthBits));
+    return (unsigned long long) (pass & 0xF) << 60 | (unsigned long long) (program & 0xFF) << 52 |
+        (unsigned long long) (textureSet & 0xFF) << 44 | (unsigned long long) (vao & 0xFF) << 36 |
+        (unsigned long long) (depthBits >> 16) << 20 | (unsigned long long) (mesh & 0xFFFFF);
+}
+
+int sortKeyPass(unsigned long long key) {
+    return (int) (key >> 60);
+}
+
+// LSD radix sort of the batches by key, one byte per round. Rounds on bytes
+// where every key agrees are skipped, which with few programs and passes is
+// most of them.
+void sortDrawBatches(std::vector<DrawBatch> &batches, std::vector<DrawBatch> &scratch) {
+    scratch.resize(batches.size());
+    for (int shift = 0; shift < 64 && batches.size() > 1; shift += 8) {
+        size_t offsets[256] = { 0 };
+        for (size_t i = 0; i < batches.size(); i++) offsets[(batches[i].key >> shift) & 0xFF]++;
+        if (offsets[(batches[0].key >> shift) & 0xFF] == batches.size()) continue;
+        size_t sum = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t count = offsets[b];
+            offsets[b] = sum;
+            sum += count;
+        }
+        for (size_t i = 0; i < batches.size(); i++) scratch[offsets[(batches[i].key >> shift) & 0xFF]++] = batches[i];
+        batches.swap(scratch);
+    }
+}
+
+// Settings for turning distant bodies into impostors.
+struct ImpostorSettings {
+    int program; // -1 disables impostors
+    int mesh;
+    float thresholdPx; // bodies with a smaller projected radius become impostors
+    float pixelScale; // projected radius in pixels = radius * pixelScale / depth
+};
+
+// Small fork-join job system. parallelFor cuts [0, count) into chunks of
+// `grain` that the workers and the calling thread claim from a shared
+// counter, and returns once all of them have run. Chunk boundaries depend only
+// on count and grain, so per-chunk outputs can be merged deterministically.
+struct JobPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::function<void(size_t, size_t)> job;
+    size_t count, grain;
+    std::atomic<size_t> nextChunk;
+    unsigned busy; // workers still inside the current job
+    unsigned long generation;
+    bool done;
+};
+
+void runChunks(JobPool &pool) {
+    size_t chunks = (pool.count + pool.grain - 1) / pool.grain;
+    for (size_t chunk = pool.nextChunk++; chunk < chunks; chunk = pool.nextChunk++) {
+        pool.job(chunk * pool.grain, std::min(pool.count, (chunk + 1) * pool.grain));
+    }
+}
+
+void jobWorkerLoop(JobPool* pool) {
+    unsigned long seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            while (pool->generation == seen && !pool->done) pool->wake.wait(lock);
+            if (pool->done) return;
+            seen = pool->generation;
+        }
+        runChunks(*pool);
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->busy == 0) pool->idle.notify_one();
+    }
+}
+
+void startJobPool(JobPool &pool, int threads) {
+    pool.busy = 0;
+    pool.generation = 0;
+    pool.done = false;
+    for (int i = 0; i < threads; i++) pool.workers.push_back(std::thread(jobWorkerLoop, &pool));
+}
+
+void parallelFor(JobPool &pool, size_t count, size_t grain, const std::function<void(size_t, size_t)> &job) {
+    if (pool.workers.empty() || count <= grain) {
+        if (count) job(0, count);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.job = job;
+        pool.count = count;
+        pool.grain = grain;
+        pool.nextChunk = 0;
+        pool.busy = (unsigned) pool.workers.size();
+        pool.generation++;
+        pool.wake.notify_all();
+    }
+    runChunks(pool);
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    while (pool.busy) pool.idle.wait(lock);
+}
+
+void stopJobPool(JobPool &pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.done = true;
+        pool.wake.notify_all();
+    }
+    for (size_t i = 0; i < pool.workers.size(); i++) pool.workers[i].join();
+}
+
+// Planes (xyz normal pointing inward, w offset) of the view frustum in world space.
+struct Frustum {
+    glm::vec4 planes[6];
+};
+
+// Gribb-Hartmann extraction from the rows of proj * view.
+Frustum extractFrustum(const glm::mat4 &viewProj) {
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++) rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+    Frustum frustum;
+    frustum.planes[0] = rows[3] + rows[0]; // left
+    frustum.planes[1] = rows[3] - rows[0]; // right
+    frustum.planes[2] = rows[3] + rows[1]; // bottom
+    frustum.planes[3] = rows[3] - rows[1]; // top
+    frustum.planes[4] = rows[3] + rows[2]; // near
+    frustum.planes[5] = rows[3] - rows[2]; // far
+    for (int i = 0; i < 6; i++) frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+    return frustum;
+}
+
+// Tests n bounding spheres given as separate x, y, z, radius arrays and sets
+// visible[i] for the ones touching the frustum. SSE handles four spheres per
+// iteration; the remainder and non-SSE builds take the scalar loop.
+void cullSpheres(const Frustum &frustum, const float* x, const float* y, const float* z, const float* r,
+    size_t n, unsigned char* visible) {
+    size_t i = 0;
+#ifdef __SSE__
+    for (; i + 4 <= n; i += 4) {
+        __m128 px = _mm_loadu_ps(x + i);
+        __m128 py = _mm_loadu_ps(y + i);
+        __m128 pz = _mm_loadu_ps(z + i);
+        __m128 negr = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(r + i));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; p++) {
+            const glm::vec4 &plane = frustum.planes[p];
+            __m128 d = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(plane.x)), _mm_mul_ps(py, _mm_set1_ps(plane.y))),
+                _mm_add_ps(_mm_mul_ps(pz, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+            inside = _mm_and_ps(inside, _mm_cmpgt_ps(d, negr));
+        }
+        int mask = _mm_movemask_ps(inside);
+        for (int k = 0; k < 4; k++) visible[i + k] = (mask >> k) & 1;
+    }
+#endif
+    for (; i < n; i++) {
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; p++) {
+            const glm::vec4 &plane = frustum.planes[p];
+            inside = plane.x * x[i] + plane.y * y[i] + plane.z * z[i] + plane.w > -r[i];
+        }
+        visible[i] = inside;
+    }
+}
+
+// Per-body occlusion queries. After the main pass each body inside the frustum
+// draws its impostor quad with colour and depth writes off; a body whose
+// query found no visible samples is skipped the next frame. Results are read
+// a frame late and only when available, so culling never stalls, at the cost
+// of a body reappearing one frame after it is uncovered. A body whose query
+// is still pending is not queried again, since reissuing it would throw away
+// the result; with the GPU several frames behind, each body is then tested
+// every few frames instead of never. Each query is its own draw call, one
+// per visible body, which at --bench sizes can cost more CPU time than the
+// culling saves on the GPU.
+struct OcclusionState {
+    bool enabled;
+    GLenum target;
+    std::vector<GLuint> queries;
+    std::vector<unsigned char> pending;
+    std::vector<unsigned char> occluded;
+};
+
+void initOcclusion(OcclusionState &occlusion, bool enabled, size_t bodyCount) {
+    occlusion.enabled = enabled;
+    occlusion.target = GLEW_VERSION_3_3 || GLEW_ARB_occlusion_query2 ? GL_ANY_SAMPLES_PASSED : GL_SAMPLES_PASSED;
+    occlusion.pending.assign(bodyCount, 0);
+    occlusion.occluded.assign(bodyCount, 0);
+    if (!enabled) return;
+    occlusion.queries.resize(bodyCount);
+    glGenQueries((GLsizei) bodyCount, &occlusion.queries[0]);
+}
+
+// Picks up whatever query results have arrived since the last frame.
+void collectOcclusion(OcclusionState &occlusion) {
+    if (!occlusion.enabled) return;
+    for (size_t i = 0; i < occlusion.queries.size(); i++) {
+        if (!occlusion.pending[i]) continue;
+        GLuint available = 0;
+        glGetQueryObjectuiv(occlusion.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) continue;
+        GLuint samples = 0;
+        glGetQueryObjectuiv(occlusion.queries[i], GL_QUERY_RESULT, &samples);
+        occlusion.occluded[i] = samples == 0;
+        occlusion.pending[i] = 0;
+    }
+}
+
+void deleteOcclusion(OcclusionState &occlusion) {
+    if (occlusion.enabled) glDeleteQueries((GLsizei) occlusion.queries.size(), &occlusion.queries[0]);
+}
+
+// Bodies per job when building draw packets; a multiple of four for the SSE cull.
+const size_t batchGrain = 256;
+
+// One job's share of the frame: its instances bucketed per (program, mesh)
+// with the nearest depth in each bucket, the bodies it wants occlusion-tested,
+// its lit bodies per caster mesh and what it culled.
+struct BatchChunk {
+    std::vector<std::vector<InstanceData> > buckets;
+    std::vector<float> nearest;
+    std::vector<size_t> queryBodies;
+    std::vector<std::vector<size_t> > casterBuckets;
+    unsigned frustumCulled, occlusionCulled;
+};
+
+// Per-chunk outputs and per-body scratch arrays, kept across frames to reuse
+// their storage.
+struct BatchBuilder {
+    int meshCount;
+    std::vector<BatchChunk> chunks;
+    std::vector<InstanceData> bodyInstances;
+    std::vector<float> x, y, z, r;
+    std::vector<unsigned char> inFrustum;
+    std::vector<int> meshLevel; // LOD level drawn this frame, -1 when culled or an impostor
+    std::vector<size_t> queryBodies; // bodies to occlusion-test after the main pass
+    std::vector<DrawBatch> sortScratch;
+};
+
+void addInstance(BatchChunk &chunk, int meshCount, int program, int mesh, float depth, const InstanceData &instance) {
+    size_t key = program * meshCount + mesh;
+    if (key >= chunk.buckets.size()) {
+        chunk.buckets.resize(key + 1);
+        chunk.nearest.resize(key + 1, FLT_MAX);
+    }
+    if (chunk.buckets[key].empty() || depth < chunk.nearest[key]) chunk.nearest[key] = depth;
+    chunk.buckets[key].push_back(instance);
+}
+
+// Builds this frame's instances and the batches that draw them, one batch per
+// (program, mesh) pair in use, sorted by their sort keys. Bodies outside the frustum
+// or occluded last frame are dropped. Each remaining lit body picks its LOD
+// level from its projected radius, or turns into an impostor below the
+// impostor threshold. Transforms, culling and bucketing run on the job pool
+// in chunks of batchGrain bodies; the chunks are merged in order, so the
+// result does not depend on the thread count. Occlusion query instances, one
+// impostor quad per body in the frustum whose last query has been read, are
+// appended after the batches starting at `queryFirst`.
+void buildDrawBatches(JobPool &pool, BatchBuilder &builder, const std::vector<Body> &bodies, const std::vector<LodChain> &chains,
+    float alpha, const glm::mat4 &view, const Frustum &frustum, const OcclusionState &occlusion,
+    const ImpostorSettings &impostors, const LodSettings &lod, const std::vector<DrawTraits> &traits,
+    std::vector<InstanceData> &instances, std::vector<DrawBatch> &batches, size_t &queryFirst) {
+    size_t n = bodies.size();
+    builder.bodyInstances.resize(n);
+    builder.x.resize(n);
+    builder.y.resize(n);
+    builder.z.resize(n);
+    builder.r.resize(n);
+    builder.inFrustum.resize(n);
+    builder.meshLevel.resize(n);
+    builder.chunks.resize((n + batchGrain - 1) / batchGrain);
+
+    parallelFor(pool, n, batchGrain, [&](size_t begin, size_t end) {
+        BatchChunk &chunk = builder.chunks[begin / batchGrain];
+        for (size_t i = 0; i < chunk.buckets.size(); i++) chunk.buckets[i].clear();
+        chunk.queryBodies.clear();
+        chunk.frustumCulled = 0;
+        chunk.occlusionCulled = 0;
+
+        for (size_t i = begin; i < end; i++) {
+            const Body &body = bodies[i];
+            float angle = body.prevAngle + (body.angle - body.prevAngle) * alpha;
+            glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(angle), glm::vec3(0.0f, 0.0f, 1.0f));
+            InstanceData &instance = builder.bodyInstances[i];
+            instance.model = glm::translate(model, body.position);
+            instance.layer = body.layer;
+            instance.radius = chains[body.globe].radius;
+            instance.fade = 1.0f;
+            builder.x[i] = instance.model[3].x;
+            builder.y[i] = instance.model[3].y;
+            builder.z[i] = instance.model[3].z;
+            builder.r[i] = instance.radius;
+        }
+        cullSpheres(frustum, &builder.x[begin], &builder.y[begin], &builder.z[begin], &builder.r[begin], end - begin,
+            &builder.inFrustum[begin]);
+
+        for (size_t i = begin; i < end; i++) {
+            builder.meshLevel[i] = -1;
+            if (!builder.inFrustum[i]) {
+                chunk.frustumCulled++;
+                continue;
+            }
+            if (occlusion.enabled && !occlusion.pending[i]) chunk.queryBodies.push_back(i);
+            if (occlusion.occluded[i]) {
+                chunk.occlusionCulled++;
+                continue;
+            }
+
+            const Body &body = bodies[i];
+            const LodChain &chain = chains[body.globe];
+            InstanceData instance = builder.bodyInstances[i];
+            float depth = -(view * instance.model[3]).z;
+            // bodies behind the camera count as close so they keep their mesh
+            float radiusPx = depth > 0.0f ? chain.radius * impostors.pixelScale / depth : 1e9f;
+            if (impostors.program >= 0 && body.program == 0 && radiusPx < impostors.thresholdPx) {
+                addInstance(chunk, builder.meshCount, impostors.program, impostors.mesh, depth, instance);
+                continue;
+            }
+            int level;
+            float fine;
+            selectLod(chain, lod, radiusPx, level, fine);
+            builder.meshLevel[i] = level;
+            if (fine > 0.0f) {
+                instance.fade = 1.0f - fine;
+                addInstance(chunk, builder.meshCount, body.program, chain.levels[level], depth, instance);
+                instance.fade = -(1.0f - fine);
+                addInstance(chunk, builder.meshCount, body.program, chain.levels[level + 1], depth, instance);
+            }
+            else {
+                addInstance(chunk, builder.meshCount, body.program, chain.levels[level], depth, instance);
+            }
+        }
+    });
+
+    frameStats.bodies += n;
+    size_t keys = 0;
+    builder.queryBodies.clear();
+    for (size_t c = 0; c < builder.chunks.size(); c++) {
+        const BatchChunk &chunk = builder.chunks[c];
+        frameStats.frustumCulled += chunk.frustumCulled;
+        frameStats.occlusionCulled += chunk.occlusionCulled;
+        keys = std::max(keys, chunk.buckets.size());
+        builder.queryBodies.insert(builder.queryBodies.end(), chunk.queryBodies.begin(), chunk.queryBodies.end());
+    }
+    instances.clear();
+    batches.clear();
+    for (size_t key = 0; key < keys; key++) {
+        DrawBatch batch = { 0, (int) (key / builder.meshCount), (int) (key % builder.meshCount), instances.size(), 0 };
+        float nearest = FLT_MAX;
+        for (size_t c = 0; c < builder.chunks.size(); c++) {
+            if (key >= builder.chunks[c].buckets.size()) continue;
+            const std::vector<InstanceData> &bucket = builder.chunks[c].buckets[key];
+            if (!bucket.empty()) nearest = std::min(nearest, builder.chunks[c].nearest[key]);
+            instances.insert(instances.end(), bucket.begin(), bucket.end());
+        }
+        batch.count = instances.size() - batch.first;
+        if (!batch.count) continue;
+        const DrawTraits &trait = traits[batch.program];
+        // a single mesh arena means a single vertex array for now
+        batch.key = makeSortKey(trait.pass, batch.program, trait.textureSet, 0, nearest, batch.mesh);
+        batches.push_back(batch);
+    }
+    sortDrawBatches(batches, builder.sortScratch);
+    queryFirst = instances.size();
+    for (size_t i = 0; i < builder.queryBodies.size(); i++) instances.push_back(builder.bodyInstances[builder.queryBodies[i]]);
+}
+
+// Orthographic light frustum fitted tightly around every lit body, looking
+// from lightPos towards their centre. The view is placed just outside the
+// casters' bounding sphere along that direction rather than at lightPos, so
+// the depth range covers them even when some lie beyond the light.
+// Bodies outside the camera frustum are included since they can still cast
+// into it. Positions come from this frame's buildDrawBatches. `extent` is the
+// larger side of the fitted rectangle in world units.
+glm::mat4 fitShadowFrustum(const BatchBuilder &builder, const std::vector<Body> &bodies, const glm::vec3 &lightPos,
+    float &extent) {
+    extent = 1.0f;
+    glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+    for (size_t i = 0; i < bodies.size(); i++) {
+        if (bodies[i].program != 0) continue;
+        glm::vec3 p(builder.x[i], builder.y[i], builder.z[i]);
+        lo = glm::min(lo, p - builder.r[i]);
+        hi = glm::max(hi, p + builder.r[i]);
+    }
+    if (lo.x > hi.x) return glm::mat4(1.0f); // nothing is lit
+    glm::vec3 center = (lo + hi) * 0.5f;
+    float radius = glm::length(hi - lo) * 0.5f;
+    glm::vec3 toCenter = center - lightPos;
+    glm::vec3 dir = glm::length(toCenter) > 1e-3f ? glm::normalize(toCenter) : glm::vec3(0.0f, -1.0f, 0.0f);
+    glm::vec3 up = fabs(dir.z) < 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+    glm::mat4 lightView = glm::lookAt(center - dir * radius, center, up);
+
+    lo = glm::vec3(FLT_MAX);
+    hi = glm::vec3(-FLT_MAX);
+    for (size_t i = 0; i < bodies.size(); i++) {
+        if (bodies[i].program != 0) continue;
+        glm::vec3 p(lightView * glm::vec4(builder.x[i], builder.y[i], builder.z[i], 1.0f));
+        lo = glm::min(lo, p - builder.r[i]);
+        hi = glm::max(hi, p + builder.r[i]);
+    }
+    extent = std::max(hi.x - lo.x, hi.y - lo.y);
+    // view space looks down -z, so the nearest body has the largest z
+    return glm::ortho(lo.x, hi.x, lo.y, hi.y, -hi.z, -lo.z) * lightView;
+}
+
+// Appends an instance for every lit body to `instances` and one batch per
+// mesh to `casters`. Each body casts with the LOD level its radius in shadow
+// map texels asks for, without cross-fading since depth cannot be dithered.
+// A body on screen never casts with a finer level than it is drawn with:
+// the coarse mesh lies inside the fine one, so a finer caster would shadow
+// the lit side of its own receiver. Bodies are bucketed on the job pool in
+// the same chunks as buildDrawBatches and merged in chunk order.
+void buildShadowCasters(JobPool &pool, BatchBuilder &builder, const std::vector<Body> &bodies,
+    const std::vector<LodChain> &chains, const LodSettings &lod, float texelsPerUnit, std::vector<InstanceData> &instances,
+    std::vector<DrawBatch> &casters) {
+    parallelFor(pool, bodies.size(), batchGrain, [&](size_t begin, size_t end) {
+        BatchChunk &chunk = builder.chunks[begin / batchGrain];
+        for (size_t m = 0; m < chunk.casterBuckets.size(); m++) chunk.casterBuckets[m].clear();
+        chunk.casterBuckets.resize(builder.meshCount);
+        for (size_t i = begin; i < end; i++) {
+            if (bodies[i].program != 0) continue;
+            const LodChain &chain = chains[bodies[i].globe];
+            int level;
+            float fine;
+            selectLod(chain, lod, chain.radius * texelsPerUnit, level, fine);
+            if (builder.meshLevel[i] >= 0) level = std::min(level, builder.meshLevel[i]);
+            chunk.casterBuckets[chain.levels[level]].push_back(i);
+        }
+    });
+    casters.clear();
+    for (int m = 0; m < builder.meshCount; m++) {
+        DrawBatch batch = { 0, 0, m, instances.size(), 0 };
+        for (size_t c = 0; c < builder.chunks.size(); c++) {
+            if (builder.chunks[c].casterBuckets.empty()) continue; // inline run, all in chunk 0
+            const std::vector<size_t> &bucket = builder.chunks[c].casterBuckets[m];
+            for (size_t i = 0; i < bucket.size(); i++) instances.push_back(builder.bodyInstances[bucket[i]]);
+        }
+        batch.count = instances.size() - batch.first;
+        if (batch.count) casters.push_back(batch);
+    }
+}
+
+float randomRange(float lo, float hi) {
+    return lo + (hi - lo) * (rand() / (float) RAND_MAX);
+}
+
+// Scatters `count` lit bodies around the scene for --bench, no further than
+// `maxExtent` from the origin along x and y.
+void spawnBenchBodies(std::vector<Body> &bodies, int count, int globeA, int globeB, float maxExtent) {
+    float extent = std::min(maxExtent, 40.0f + sqrt((float) count) * 2.0f);
+    for (int i = 0; i < count; i++) {
+        Body body;
+        body.program = 0;
+        body.globe = rand() % 2 ? globeA : globeB;
+        body.layer = (float) (rand() % 2);
+        body.position = glm::vec3(randomRange(-extent, extent), randomRange(-extent, extent), randomRange(-20.0f, 20.0f));
+        body.angle = randomRange(0.0f, 360.0f);
+        body.rate = randomRange(-1.0f, 1.0f);
+        body.prevAngle = body.angle;
+        bodies.push_back(body);
+    }
+}
+
+// Length of one animation tick. Bodies advance by their rate once per tick.
+const double simulationStep = 0.02;
+
+// Advances every body by whole ticks out of `accumulator` seconds and returns
+// how far the leftover time reaches into the next tick, for interpolation.
+float stepSimulation(std::vector<Body> &bodies, double &accumulator, bool running) {
+    // cap the catch-up after a stall (window drag, breakpoint) instead of spiralling
+    if (accumulator > 0.25) accumulator = 0.25;
+    while (accumulator >= simulationStep) {
+        for (size_t i = 0; i < bodies.size(); i++) {
+            bodies[i].prevAngle = bodies[i].angle;
+            if (running) bodies[i].angle += bodies[i].rate;
+        }
+        accumulator -= simulationStep;
+    }
+    return (float) (accumulator / simulationStep);
+}
+
+enum Pacing {
+    PACING_VSYNC,
+    PACING_ADAPTIVE, // late frames tear instead of waiting a whole refresh
+    PACING_UNCAPPED
+};
+
+void applyPacing(Pacing pacing) {
+    if (pacing == PACING_ADAPTIVE && SDL_GL_SetSwapInterval(-1) == 0) return;
+    if (pacing == PACING_ADAPTIVE) printf("Adaptive vsync unsupported, using vsync.\n");
+    SDL_GL_SetSwapInterval(pacing == PACING_UNCAPPED ? 0 : 1);
+}
+
+// Sleeps most of the way to the deadline, then spins the last stretch since
+// sleep granularity is often a millisecond or worse.
+void waitUntil(std::chrono::high_resolution_clock::time_point deadline) {
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    if (deadline - now > std::chrono::milliseconds(2)) {
+        std::this_thread::sleep_for(deadline - now - std::chrono::milliseconds(1));
+    }
+    while (std::chrono::high_resolution_clock::now() < deadline) {}
+}
+
+// A linked program with every uniform location resolved once at link time.
+// Each location keeps a shadow copy of the last value sent to GL, so setting
+// a uniform to the value it already holds costs no GL call.
+struct ShaderProgram {
+    GLuint id;
+    std::map<std::string, GLint> locations;
+    std::vector<std::vector<unsigned char> > shadow;
+};
+
+// Binding point of the std140 Frame block shared by every program.
+const GLuint frameBlockBinding = 0;
+
+ShaderProgram linkProgram(GLuint vertexShader, GLuint fragmentShader) {
+    ShaderProgram program;
+    program.id = glCreateProgram();
+    glAttachShader(program.id, vertexShader);
+    glAttachShader(program.id, fragmentShader);
+    glBindAttribLocation(program.id, posLocation, "position");
+    glBindAttribLocation(program.id, texLocation, "texcoord");
+    glBindAttribLocation(program.id, normalLocation, "normal");
+    glBindAttribLocation(program.id, modelLocation, "model");
+    glBindAttribLocation(program.id, layerLocation, "layer");
+    glBindAttribLocation(program.id, radiusLocation, "radius");
+    glBindAttribLocation(program.id, fadeLocation, "fade");
+    glLinkProgram(program.id);
+
+    GLint status;
+    glGetProgramiv(program.id, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        char buffer[512];
+        glGetProgramInfoLog(program.id, 512, NULL, buffer);
+        printf("Program failed to link:\n%s", buffer);
+    }
+
+    GLint count = 0;
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORMS, &count);
+    for (GLint i = 0; i < count; i++) {
+        char name[256];
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(program.id, i, sizeof(name), NULL, &size, &type, name);
+        GLint location = glGetUniformLocation(program.id, name);
+        if (location < 0) continue; // block members have no location
+        std::string key(name);
+        if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0) key.resize(key.size() - 3);
+        program.locations[key] = location;
+        if ((size_t) location >= program.shadow.size()) program.shadow.resize(location + 1);
+    }
+
+    GLuint block = glGetUniformBlockIndex(program.id, "Frame");
+    if (block != GL_INVALID_INDEX) glUniformBlockBinding(program.id, block, frameBlockBinding);
+    return program;
+}
+
+// Setup-time lookup; keep the result instead of calling this per frame.
+GLint uniformLocation(const ShaderProgram &program, const char* name) {
+    std::map<std::string, GLint>::const_iterator it = program.locations.find(name);
+    if (it == program.locations.end()) {
+        printf("Uniform %s is not active.\n", name);
+        return -1;
+    }
+    return it->second;
+}
+
+// Returns true when the value differs from the shadow copy and has to be sent.
+bool uniformChanged(ShaderProgram &program, GLint location, const void* data, size_t bytes) {
+    if (location < 0) return false;
+    std::vector<unsigned char> &shadow = program.shadow[location];
+    if (shadow.size() == bytes && memcmp(&shadow[0], data, bytes) == 0) {
+        frameStats.uniformsSkipped++;
+        return false;
+    }
+    shadow.assign((const unsigned char*) data, (const unsigned char*) data + bytes);
+    frameStats.uniformUploads++;
+    frameStats.bytesUploaded += bytes;
+    return true;
+}
+
+// The setters assume the program is current.
+void setUniform(ShaderProgram &program, GLint location, int value) {
+    if (uniformChanged(program, location, &value, sizeof(value))) GLCALL(glUniform1i(location, value));
+}
+
+void setUniform(ShaderProgram &program, GLint location, float value) {
+    if (uniformChanged(program, location, &value, sizeof(value))) GLCALL(glUniform1f(location, value));
+}
+
+void setUniform(ShaderProgram &program, GLint location, const glm::vec2 &value) {
+    if (uniformChanged(program, location, glm::value_ptr(value), sizeof(value))) {
+        GLCALL(glUniform2fv(location, 1, glm::value_ptr(value)));
+    }
+}
+
+void setUniform(ShaderProgram &program, GLint location, const glm::vec3 &value) {
+    if (uniformChanged(program, location, glm::value_ptr(value), sizeof(value))) {
+        GLCALL(glUniform3fv(location, 1, glm::value_ptr(value)));
+    }
+}
+
+void setUniform(ShaderProgram &program, GLint location, const glm::vec4 &value) {
+    if (uniformChanged(program, location, glm::value_ptr(value), sizeof(value))) {
+        GLCALL(glUniform4fv(location, 1, glm::value_ptr(value)));
+    }
+}
+
+void setUniform(ShaderProgram &program, GLint location, const glm::mat4 &value) {
+    if (uniformChanged(program, location, glm::value_ptr(value), sizeof(value))) {
+        GLCALL(glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value)));
+    }
+}
+
+// CPU mirror of the std140 Frame block; vec3s are padded to vec4.
+struct FrameUniforms {
+    glm::mat4 view;
+    glm::mat4 proj;
+    glm::vec4 lightColor;
+    glm::vec4 lightPos;
+    glm::vec4 viewPos;
+};
+
+// Uploads the frame block only when something in it changed since last time.
+void updateFrameUniforms(GLuint ubo, FrameUniforms &uploaded, const FrameUniforms &current) {
+    if (memcmp(&uploaded, &current, sizeof(FrameUniforms)) == 0) return;
+    uploaded = current;
+    frameStats.stateChanges++;
+    frameStats.bytesUploaded += sizeof(FrameUniforms);
+    GLCALL(glBindBuffer(GL_UNIFORM_BUFFER, ubo));
+    GLCALL(glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &current));
+}
+
+#ifdef HEADLESS_EGL
+// A surfaceless EGL context, enough to render into FBOs on machines without a
+// display or GPU (Mesa llvmpipe included).
+struct HeadlessContext {
+    EGLDisplay display;
+    EGLContext context;
+};
+
+bool createHeadlessContext(HeadlessContext &headless) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    headless.display = EGL_NO_DISPLAY;
+    if (getPlatformDisplay) headless.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (headless.display == EGL_NO_DISPLAY) headless.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (headless.display == EGL_NO_DISPLAY || !eglInitialize(headless.display, NULL, NULL)) {
+        printf("Failed to initialise EGL.\n");
+        return false;
+    }
+    eglBindAPI(EGL_OPENGL_API);
+
+    const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint configCount = 0;
+    eglChooseConfig(headless.display, configAttribs, &config, 1, &configCount);
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 2,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    headless.context = eglCreateContext(headless.display, configCount ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttribs);
+    if (headless.context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, headless.context)) {
+        printf("Failed to create a surfaceless GL context (0x%x).\n", eglGetError());
+        return false;
+    }
+    return true;
+}
+
+void destroyHeadlessContext(HeadlessContext &headless) {
+    eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(headless.display, headless.context);
+    eglTerminate(headless.display);
+}
+#endif
+
+// Offscreen colour + depth target for headless rendering.
+struct RenderTarget {
+    GLuint fbo, color, depth;
+    int width, height;
+};
+
+RenderTarget makeRenderTarget(int width, int height) {
+    RenderTarget target;
+    target.width = width;
+    target.height = height;
+    glGenFramebuffers(1, &target.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glGenRenderbuffers(1, &target.color);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color);
+    glGenRenderbuffers(1, &target.depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, target.depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Offscreen framebuffer is incomplete.\n");
+    }
+    return target;
+}
+
+void deleteRenderTarget(RenderTarget &target) {
+    glDeleteRenderbuffers(1, &target.depth);
+    glDeleteRenderbuffers(1, &target.color);
+    glDeleteFramebuffers(1, &target.fbo);
+}
+
+// Depth texture the shadow pass renders from the light. Comparison sampling
+// gives bilinear PCF for free; outside the map the border counts as lit.
+struct ShadowMap {
+    GLuint fbo, texture;
+    int size;
+};
+
+const GLenum shadowUnit = GL_TEXTURE5;
+
+bool makeShadowMap(ShadowMap &shadow, int size) {
+    shadow.size = size;
+    glGenTextures(1, &shadow.texture);
+    glBindTexture(GL_TEXTURE_2D, shadow.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    const GLfloat border[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+    glGenFramebuffers(1, &shadow.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadow.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadow.texture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Shadow framebuffer is incomplete.\n");
+        return false;
+    }
+    return true;
+}
+
+void deleteShadowMap(ShadowMap &shadow) {
+    glDeleteFramebuffers(1, &shadow.fbo);
+    glDeleteTextures(1, &shadow.texture);
+}
+
+// Bloom and tonemapping parameters for the HDR path.
+struct HdrSettings {
+    bool enabled;
+    int bloomLevels;
+    float threshold; // scene brightness where bloom starts
+    float knee; // width of the soft transition around the threshold
+    float bloomStrength;
+    float exposure;
+    float sunEmission; // multiplies the sun's colour so it rises above 1
+};
+
+// HDR scene colour and its bloom chain. The scene renders into an RGBA16F
+// texture. Bloom levels start at half size and halve down the chain; they use
+// R11F_G11F_B10F, half the bytes of RGBA16F, since bloom needs no alpha.
+struct HdrTarget {
+    GLuint fbo, color, depth;
+    int width, height;
+    std::vector<GLuint> bloomFbos, bloomTextures;
+    std::vector<glm::ivec2> bloomSizes;
+    GLuint emptyVao; // the fullscreen triangle needs a bound VAO but no attributes
+};
+
+// Post-processing programs and the uniforms they set per draw.
+struct PostPrograms {
+    ShaderProgram down, up, tonemap;
+    GLint downTexel, downThreshold, upTexel;
+};
+
+const GLenum postSourceUnit = GL_TEXTURE3;
+const GLenum postBloomUnit = GL_TEXTURE4;
+
+GLuint makeColorTexture(GLenum format, int width, int height) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, GL_RGBA, GL_HALF_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return texture;
+}
+
+bool makeHdrTarget(HdrTarget &hdr, int width, int height, int bloomLevels) {
+    hdr.width = width;
+    hdr.height = height;
+    glGenFramebuffers(1, &hdr.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, hdr.fbo);
+    hdr.color = makeColorTexture(GL_RGBA16F, width, height);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hdr.color, 0);
+    glGenRenderbuffers(1, &hdr.depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, hdr.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, hdr.depth);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+    glm::ivec2 size(width, height);
+    for (int i = 0; i < bloomLevels && size.x > 1 && size.y > 1; i++) {
+        size /= 2;
+        GLuint fbo;
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        GLuint texture = makeColorTexture(GL_R11F_G11F_B10F, size.x, size.y);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+        complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        hdr.bloomFbos.push_back(fbo);
+        hdr.bloomTextures.push_back(texture);
+        hdr.bloomSizes.push_back(size);
+    }
+    glGenVertexArrays(1, &hdr.emptyVao);
+    if (!complete) printf("HDR framebuffers are incomplete.\n");
+    return complete && !hdr.bloomFbos.empty();
+}
+
+void deleteHdrTarget(HdrTarget &hdr) {
+    glDeleteVertexArrays(1, &hdr.emptyVao);
+    glDeleteTextures((GLsizei) hdr.bloomTextures.size(), &hdr.bloomTextures[0]);
+    glDeleteFramebuffers((GLsizei) hdr.bloomFbos.size(), &hdr.bloomFbos[0]);
+    glDeleteRenderbuffers(1, &hdr.depth);
+    glDeleteTextures(1, &hdr.color);
+    glDeleteFramebuffers(1, &hdr.fbo);
+}
+
+// Memory traffic of the post passes per frame, counting every pixel written
+// and every texel read once since neighbouring bilinear taps hit the cache.
+size_t postTraffic(const HdrTarget &hdr) {
+    size_t pixels = (size_t) hdr.width * hdr.height;
+    size_t bytes = pixels * 8 * 2 + pixels * 4; // the scene read twice, an RGBA8 result written
+    size_t n = hdr.bloomSizes.size();
+    for (size_t i = 0; i < n; i++) {
+        size_t level = (size_t) hdr.bloomSizes[i].x * hdr.bloomSizes[i].y * 4;
+        bytes += level; // written going down
+        if (i + 1 < n) bytes += level * 3; // read by the next step down, then blended onto going up
+        bytes += level; // read going up, or by tonemap for the first level
+    }
+    return bytes;
+}
+
+void drawFullscreen(const HdrTarget &hdr) {
+    bindVertexArray(hdr.emptyVao);
+    frameStats.draws++;
+    GLCALL(glDrawArrays(GL_TRIANGLES, 0, 3));
+}
+
+// Filters the scene down the bloom chain, thresholding on the first step.
+// Leaves depth testing off for the passes that follow.
+void bloomDownsample(HdrTarget &hdr, PostPrograms &post, const HdrSettings &settings) {
+    GLCALL(glDisable(GL_DEPTH_TEST));
+    useProgram(post.down.id);
+    for (size_t i = 0; i < hdr.bloomFbos.size(); i++) {
+        glm::ivec2 source = i ? hdr.bloomSizes[i - 1] : glm::ivec2(hdr.width, hdr.height);
+        GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, hdr.bloomFbos[i]));
+        GLCALL(glViewport(0, 0, hdr.bloomSizes[i].x, hdr.bloomSizes[i].y));
+        bindTexture(postSourceUnit, GL_TEXTURE_2D, i ? hdr.bloomTextures[i - 1] : hdr.color);
+        setUniform(post.down, post.downTexel, 1.0f / glm::vec2(source));
+        setUniform(post.down, post.downThreshold, i ? -1.0f : settings.threshold);
+        drawFullscreen(hdr);
+    }
+}
+
+// Adds each level onto the next larger one, so the first level ends up with
+// the sum of the whole chain.
+void bloomUpsample(HdrTarget &hdr, PostPrograms &post) {
+    useProgram(post.up.id);
+    GLCALL(glEnable(GL_BLEND));
+    GLCALL(glBlendFunc(GL_ONE, GL_ONE));
+    for (size_t i = hdr.bloomFbos.size() - 1; i > 0; i--) {
+        GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, hdr.bloomFbos[i - 1]));
+        GLCALL(glViewport(0, 0, hdr.bloomSizes[i - 1].x, hdr.bloomSizes[i - 1].y));
+        bindTexture(postSourceUnit, GL_TEXTURE_2D, hdr.bloomTextures[i]);
+        setUniform(post.up, post.upTexel, 1.0f / glm::vec2(hdr.bloomSizes[i]));
+        drawFullscreen(hdr);
+    }
+    GLCALL(glDisable(GL_BLEND));
+}
+
+// Resolves scene and bloom into `fbo` and restores depth testing.
+void tonemap(HdrTarget &hdr, PostPrograms &post, GLuint fbo) {
+    GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+    GLCALL(glViewport(0, 0, hdr.width, hdr.height));
+    useProgram(post.tonemap.id);
+    bindTexture(postSourceUnit, GL_TEXTURE_2D, hdr.color);
+    bindTexture(postBloomUnit, GL_TEXTURE_2D, hdr.bloomTextures[0]);
+    drawFullscreen(hdr);
+    GLCALL(glEnable(GL_DEPTH_TEST));
+}
+
+// Streams rendered frames to disk. glReadPixels goes into one of two pixel
+// pack buffers and the other one, filled a frame earlier, is mapped and
+// handed to a writer thread, so neither the readback nor the file I/O waits
+// on the GPU.
+struct FrameCapture {
+    std::string dir;
+    std::string format; // ppm, tga or bmp
+    int width, height;
+    GLuint pbo[2];
+    long pending[2]; // frame number held by each PBO, -1 when empty
+    long nextFrame;
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::pair<long, std::vector<unsigned char> > > queue;
+    bool done;
+};
+
+// Flips the bottom-up GL rows and writes one frame.
+void writeFrame(const FrameCapture &capture, long index, std::vector<unsigned char> &pixels) {
+    int stride = capture.width * 4;
+    std::vector<unsigned char> row(stride);
+    for (int y = 0; y < capture.height / 2; y++) {
+        unsigned char* top = &pixels[y * stride];
+        unsigned char* bottom = &pixels[(capture.height - 1 - y) * stride];
+        memcpy(&row[0], top, stride);
+        memcpy(top, bottom, stride);
+        memcpy(bottom, &row[0], stride);
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/frame_%05ld.%s", capture.dir.c_str(), index, capture.format.c_str());
+    if (capture.format == "ppm") {
+        FILE* file = fopen(path, "wb");
+        if (!file) {
+            printf("Failed to open %s\n", path);
+            return;
+        }
+        fprintf(file, "P6\n%d %d\n255\n", capture.width, capture.height);
+        std::vector<unsigned char> rgb(capture.width * 3);
+        for (int y = 0; y < capture.height; y++) {
+            for (int x = 0; x < capture.width; x++) memcpy(&rgb[x * 3], &pixels[y * stride + x * 4], 3);
+            fwrite(&rgb[0], 1, rgb.size(), file);
+        }
+        fclose(file);
+    }
+    else {
+        int type = capture.format == "bmp" ? SOIL_SAVE_TYPE_BMP : SOIL_SAVE_TYPE_TGA;
+        if (!SOIL_save_image(path, type, capture.width, capture.height, 4, &pixels[0])) printf("Failed to write %s\n", path);
+    }
+}
+
+void captureWriterLoop(FrameCapture* capture) {
+    while (true) {
+        std::pair<long, std::vector<unsigned char> > frame;
+        {
+            std::unique_lock<std::mutex> lock(capture->mutex);
+            while (capture->queue.empty() && !capture->done) capture->wake.wait(lock);
+            if (capture->queue.empty()) return;
+            frame.first = capture->queue.front().first;
+            frame.second.swap(capture->queue.front().second);
+            capture->queue.pop_front();
+        }
+        writeFrame(*capture, frame.first, frame.second);
+    }
+}
+
+void startCapture(FrameCapture &capture, const std::string &dir, const std::string &format, int width, int height) {
+    capture.dir = dir;
+    capture.format = format;
+    capture.width = width;
+    capture.height = height;
+    capture.nextFrame = 0;
+    capture.done = false;
+    mkdir(dir.c_str(), 0755);
+    glGenBuffers(2, capture.pbo);
+    for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+        capture.pending[i] = -1;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    capture.writer = std::thread(captureWriterLoop, &capture);
+}
+
+// Maps a PBO whose readback was issued earlier and queues its pixels.
+void drainCapturePbo(FrameCapture &capture, int slot) {
+    if (capture.pending[slot] < 0) return;
+    GLCALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo[slot]));
+    size_t bytes = capture.width * capture.height * 4;
+    const unsigned char* data = (const unsigned char*) GLCALL(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT));
+    if (data) {
+        std::vector<unsigned char> pixels(data, data + bytes);
+        GLCALL(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+        std::lock_guard<std::mutex> lock(capture.mutex);
+        capture.queue.push_back(std::make_pair(capture.pending[slot], std::vector<unsigned char>()));
+        capture.queue.back().second.swap(pixels);
+        capture.wake.notify_one();
+    }
+    capture.pending[slot] = -1;
+}
+
+// Reads the currently bound read framebuffer.
+void captureFrame(FrameCapture &capture) {
+    int slot = capture.nextFrame % 2;
+    drainCapturePbo(capture, slot);
+    GLCALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.pbo[slot]));
+    GLCALL(glReadPixels(0, 0, capture.width, capture.height, GL_RGBA, GL_UNSIGNED_BYTE, 0));
+    capture.pending[slot] = capture.nextFrame++;
+    drainCapturePbo(capture, 1 - slot);
+    GLCALL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+}
+
+void finishCapture(FrameCapture &capture) {
+    int slot = capture.nextFrame % 2;
+    drainCapturePbo(capture, slot);
+    drainCapturePbo(capture, 1 - slot);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    {
+        std::lock_guard<std::mutex> lock(capture.mutex);
+        capture.done = true;
+        capture.wake.notify_one();
+    }
+    capture.writer.join();
+    glDeleteBuffers(2, capture.pbo);
+    printf("Wrote %ld frames to %s\n", capture.nextFrame, capture.dir.c_str());
+}
+
+// Fixed-width bucket histogram used for the percentiles printed on exit.
+struct Histogram {
+    float bucketWidth;
+    std::vector<unsigned> buckets;
+    unsigned count;
+};
+
+Histogram makeHistogram(float bucketWidth, size_t bucketCount) {
+    Histogram histogram;
+    histogram.bucketWidth = bucketWidth;
+    histogram.buckets.assign(bucketCount, 0);
+    histogram.count = 0;
+    return histogram;
+}
+
+void addSample(Histogram &histogram, float value) {
+    size_t bucket = (size_t) std::max(0.0f, value / histogram.bucketWidth);
+    if (bucket >= histogram.buckets.size()) bucket = histogram.buckets.size() - 1;
+    histogram.buckets[bucket]++;
+    histogram.count++;
+}
+
+// Lower edge of the bucket holding the p-th percentile.
+float percentile(const Histogram &histogram, float p) {
+    unsigned target = (unsigned) ceil(histogram.count * p / 100.0f);
+    unsigned seen = 0;
+    for (size_t i = 0; i < histogram.buckets.size(); i++) {
+        seen += histogram.buckets[i];
+        if (seen >= target && seen > 0) return i * histogram.bucketWidth;
+    }
+    return histogram.buckets.size() * histogram.bucketWidth;
+}
+
+const int profilerMaxPasses = 16;
+// Frames a GPU timer result may lag behind before its slot is reused.
+const int profilerRing = 4;
+
+struct FrameRecord {
+    long frame;
+    double cpuStartMs;
+    float cpuMs;
+    float gpuMs[profilerMaxPasses]; // negative when the result was dropped
+    FrameStats stats;
+};
+
+// Records CPU frame time, per-pass GPU time and the frame counters. GPU time
+// comes from GL_TIME_ELAPSED queries kept in a ring a few frames deep; a
+// frame's results are collected once available and never waited on, so the
+// profiler does not stall the pipeline.
+struct Profiler {
+    bool gpuTimers;
+    std::vector<std::string> passNames;
+    GLuint queries[profilerRing][profilerMaxPasses];
+    bool issued[profilerRing][profilerMaxPasses];
+    long ringFrame[profilerRing]; // the frame using each slot
+
+    int slot;
+    int openPass;
+    std::chrono::high_resolution_clock::time_point start, frameStart;
+
+    // every frame when a CSV or trace is written, otherwise only the last
+    // profilerRing frames, enough for their timings to land
+    bool keepRecords;
+    long frames;
+    std::vector<FrameRecord> records;
+    Histogram cpuHistogram;
+    std::vector<Histogram> gpuHistograms;
+    Histogram drawHistogram, stateHistogram, skippedHistogram, uploadHistogram;
+    Histogram frustumHistogram, occlusionHistogram;
+};
+
+void initProfiler(Profiler &profiler, bool keepRecords) {
+    profiler.gpuTimers = GLEW_ARB_timer_query || GLEW_VERSION_3_3;
+    profiler.keepRecords = keepRecords;
+    profiler.frames = 0;
+    if (!keepRecords) profiler.records.resize(profilerRing);
+    if (profiler.gpuTimers) glGenQueries(profilerRing * profilerMaxPasses, &profiler.queries[0][0]);
+    memset(profiler.issued, 0, sizeof(profiler.issued));
+    for (int i = 0; i < profilerRing; i++) profiler.ringFrame[i] = -1;
+    profiler.slot = 0;
+    profiler.openPass = -1;
+    profiler.start = std::chrono::high_resolution_clock::now();
+    profiler.cpuHistogram = makeHistogram(0.05f, 2000);
+    profiler.drawHistogram = makeHistogram(1.0f, 4096);
+    profiler.stateHistogram = makeHistogram(1.0f, 4096);
+    profiler.skippedHistogram = makeHistogram(1.0f, 4096);
+    profiler.uploadHistogram = makeHistogram(64.0f, 1 << 18);
+    profiler.frustumHistogram = makeHistogram(1.0f, 1 << 17);
+    profiler.occlusionHistogram = makeHistogram(1.0f, 1 << 17);
+}
+
+int profilerPass(Profiler &profiler, const char* name) {
+    for (size_t i = 0; i < profiler.passNames.size(); i++) {
+        if (profiler.passNames[i] == name) return (int) i;
+    }
+    if (profiler.passNames.size() >= (size_t) profilerMaxPasses) return -1;
+    profiler.passNames.push_back(name);
+    profiler.gpuHistograms.push_back(makeHistogram(0.01f, 5000));
+    return (int) profiler.passNames.size() - 1;
+}
+
+FrameRecord &frameRecord(Profiler &profiler, long frame) {
+    return profiler.records[profiler.keepRecords ? frame : frame % profilerRing];
+}
+
+// Moves finished GPU timings of the frame in `slot` into its record.
+void collectGpuTimes(Profiler &profiler, int slot, bool wait) {
+    long record = profiler.ringFrame[slot];
+    if (record < 0) return;
+    for (int pass = 0; pass < profilerMaxPasses; pass++) {
+        if (!profiler.issued[slot][pass]) continue;
+        GLuint query = profiler.queries[slot][pass];
+        GLint available = GL_TRUE;
+        if (!wait) glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+            frameRecord(profiler, record).gpuMs[pass] = ns / 1.0e6f;
+            addSample(profiler.gpuHistograms[pass], ns / 1.0e6f);
+        }
+        profiler.issued[slot][pass] = false;
+    }
+    profiler.ringFrame[slot] = -1;
+}
+
+void beginProfiledFrame(Profiler &profiler) {
+    profiler.slot = (profiler.slot + 1) % profilerRing;
+    // the slot was last used profilerRing frames ago; whatever is still pending is dropped
+    collectGpuTimes(profiler, profiler.slot, false);
+    profiler.frameStart = std::chrono::high_resolution_clock::now();
+
+    FrameRecord record;
+    memset(&record, 0, sizeof(record));
+    record.frame = profiler.frames++;
+    record.cpuStartMs = std::chrono::duration<double, std::milli>(profiler.frameStart - profiler.start).count();
+    for (int i = 0; i < profilerMaxPasses; i++) record.gpuMs[i] = -1.0f;
+    if (profiler.keepRecords) profiler.records.push_back(record);
+    else frameRecord(profiler, record.frame) = record;
+    profiler.ringFrame[profiler.slot] = record.frame;
+}
+
+// Timer queries cannot nest, so passes run back to back.
+void beginPass(Profiler &profiler, const char* name) {
+    int pass = profilerPass(profiler, name);
+    if (!profiler.gpuTimers || pass < 0) return;
+    GLCALL(glBeginQuery(GL_TIME_ELAPSED, profiler.queries[profiler.slot][pass]));
+    profiler.openPass = pass;
+}
+
+void endPass(Profiler &profiler) {
+    if (profiler.openPass < 0) return;
+    GLCALL(glEndQuery(GL_TIME_ELAPSED));
+    profiler.issued[profiler.slot][profiler.openPass] = true;
+    profiler.openPass = -1;
+}
+
+void endProfiledFrame(Profiler &profiler) {
+    FrameRecord &record = frameRecord(profiler, profiler.frames - 1);
+    record.cpuMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - profiler.frameStart).count();
+    record.stats = frameStats;
+    addSample(profiler.cpuHistogram, record.cpuMs);
+    addSample(profiler.drawHistogram, (float) frameStats.draws);
+    addSample(profiler.stateHistogram, (float) frameStats.stateChanges);
+    addSample(profiler.skippedHistogram, (float) frameStats.stateSkipped);
+    addSample(profiler.uploadHistogram, (float) frameStats.bytesUploaded);
+    addSample(profiler.frustumHistogram, (float) frameStats.frustumCulled);
+    addSample(profiler.occlusionHistogram, (float) frameStats.occlusionCulled);
+}
+
+void printProfile(Profiler &profiler) {
+    for (int i = 0; i < profilerRing; i++) collectGpuTimes(profiler, i, true);
+    if (profiler.cpuHistogram.count == 0) return;
+    printf("Profile over %u frames (p50 / p99):\n", profiler.cpuHistogram.count);
+    printf("  cpu frame          %8.2f / %8.2f ms\n", percentile(profiler.cpuHistogram, 50), percentile(profiler.cpuHistogram, 99));
+    for (size_t i = 0; i < profiler.passNames.size(); i++) {
+        if (profiler.gpuHistograms[i].count == 0) continue;
+        printf("  gpu %-14s %8.2f / %8.2f ms\n", profiler.passNames[i].c_str(),
+            percentile(profiler.gpuHistograms[i], 50), percentile(profiler.gpuHistograms[i], 99));
+    }
+    printf("  draws              %8.0f / %8.0f\n", percentile(profiler.drawHistogram, 50), percentile(profiler.drawHistogram, 99));
+    printf("  state changes      %8.0f / %8.0f\n", percentile(profiler.stateHistogram, 50), percentile(profiler.stateHistogram, 99));
+    printf("  redundant binds    %8.0f / %8.0f skipped\n", percentile(profiler.skippedHistogram, 50),
+        percentile(profiler.skippedHistogram, 99));
+    printf("  uploads            %8.1f / %8.1f KiB\n", percentile(profiler.uploadHistogram, 50) / 1024,
+        percentile(profiler.uploadHistogram, 99) / 1024);
+    printf("  frustum culled     %8.0f / %8.0f of %u bodies\n", percentile(profiler.frustumHistogram, 50),
+        percentile(profiler.frustumHistogram, 99), frameRecord(profiler, profiler.frames - 1).stats.bodies);
+    printf("  occluded           %8.0f / %8.0f\n", percentile(profiler.occlusionHistogram, 50),
+        percentile(profiler.occlusionHistogram, 99));
+}
+
+void writeProfileCsv(const Profiler &profiler, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        printf("Failed to open %s\n", path);
+        return;
+    }
+    fprintf(file, "frame,cpu_ms");
+    for (size_t i = 0; i < profiler.passNames.size(); i++) fprintf(file, ",gpu_%s_ms", profiler.passNames[i].c_str());
+    fprintf(file, ",gl_calls,draws,state_changes,state_skipped,bytes_uploaded,bodies,frustum_culled,occlusion_culled\n");
+    for (size_t f = 0; f < profiler.records.size(); f++) {
+        const FrameRecord &record = profiler.records[f];
+        fprintf(file, "%ld,%.4f", record.frame, record.cpuMs);
+        for (size_t i = 0; i < profiler.passNames.size(); i++) {
+            if (record.gpuMs[i] < 0.0f) fprintf(file, ",");
+            else fprintf(file, ",%.4f", record.gpuMs[i]);
+        }
+        fprintf(file, ",%u,%u,%u,%u,%u,%u,%u,%u\n", record.stats.glCalls, record.stats.draws, record.stats.stateChanges,
+            record.stats.stateSkipped, record.stats.bytesUploaded, record.stats.bodies, record.stats.frustumCulled, record.stats.occlusionCulled);
+    }
+    fclose(file);
+}
+
+// Chrome trace (chrome://tracing, Perfetto) with CPU frames on one track and
+// GPU passes on another. Timer queries only give durations, so GPU passes are
+// laid end to end from the start of the frame that issued them.
+void writeProfileTrace(const Profiler &profiler, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        printf("Failed to open %s\n", path);
+        return;
+    }
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+    for (size_t f = 0; f < profiler.records.size(); f++) {
+        const FrameRecord &record = profiler.records[f];
+        double ts = record.cpuStartMs * 1000.0;
+        fprintf(file, ",\n{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.1f,\"dur\":%.1f,"
+            "\"args\":{\"draws\":%u,\"state_changes\":%u,\"bytes_uploaded\":%u,\"frustum_culled\":%u,\"occlusion_culled\":%u}}",
+            ts, record.cpuMs * 1000.0, record.stats.draws, record.stats.stateChanges, record.stats.bytesUploaded,
+            record.stats.frustumCulled, record.stats.occlusionCulled);
+        for (size_t i = 0; i < profiler.passNames.size(); i++) {
+            if (record.gpuMs[i] < 0.0f) continue;
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.1f,\"dur\":%.1f}",
+                profiler.passNames[i].c_str(), ts, record.gpuMs[i] * 1000.0);
+            ts += record.gpuMs[i] * 1000.0;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+}
+
+void deleteProfiler(Profiler &profiler) {
+    if (profiler.gpuTimers) glDeleteQueries(profilerRing * profilerMaxPasses, &profiler.queries[0][0]);
+}
+
+// The frame as a list of passes naming the resources they read and write.
+// Passes are declared in submission order. compileRenderGraph walks back from
+// the graph's outputs and keeps only passes that contribute to them, and
+// executeRenderGraph runs the survivors whose active() test passes, each in
+// its own profiler scope. Resources listed as inputs come from the CPU side
+// of the frame, such as the draw packets.
+struct RenderPass {
+    std::string name;
+    std::vector<std::string> reads, writes;
+    std::function<void()> execute;
+    std::function<bool()> active; // empty means always
+    bool timed; // false for passes that only wait, such as present
+};
+
+struct RenderGraph {
+    std::vector<RenderPass> passes;
+    std::vector<std::string> inputs, outputs;
+    std::vector<size_t> order;
+};
+
+size_t addPass(RenderGraph &graph, const char* name, const std::vector<std::string> &reads,
+    const std::vector<std::string> &writes, const std::function<void()> &execute,
+    const std::function<bool()> &active = std::function<bool()>(), bool timed = true) {
+    RenderPass pass = { name, reads, writes, execute, active, timed };
+    graph.passes.push_back(pass);
+    return graph.passes.size() - 1;
+}
+
+bool compileRenderGraph(RenderGraph &graph) {
+    bool valid = true;
+    std::set<std::string> written(graph.inputs.begin(), graph.inputs.end());
+    for (size_t i = 0; i < graph.passes.size(); i++) {
+        const RenderPass &pass = graph.passes[i];
+        for (size_t r = 0; r < pass.reads.size(); r++) {
+            if (written.count(pass.reads[r])) continue;
+            printf("Render pass %s reads %s before anything writes it.\n", pass.name.c_str(), pass.reads[r].c_str());
+            valid = false;
+        }
+        written.insert(pass.writes.begin(), pass.writes.end());
+    }
+
+    std::set<std::string> needed(graph.outputs.begin(), graph.outputs.end());
+    std::vector<bool> keep(graph.passes.size(), false);
+    for (size_t i = graph.passes.size(); i-- > 0;) {
+        const RenderPass &pass = graph.passes[i];
+        for (size_t w = 0; w < pass.writes.size() && !keep[i]; w++) keep[i] = needed.count(pass.writes[w]) != 0;
+        if (keep[i]) needed.insert(pass.reads.begin(), pass.reads.end());
+    }
+    graph.order.clear();
+    printf("Render graph:");
+    for (size_t i = 0; i < graph.passes.size(); i++) {
+        if (!keep[i]) continue;
+        graph.order.push_back(i);
+        printf(" %s", graph.passes[i].name.c_str());
+    }
+    printf("\n");
+    return valid;
+}
+
+void executeRenderGraph(RenderGraph &graph, Profiler &profiler) {
+    for (size_t i = 0; i < graph.order.size(); i++) {
+        RenderPass &pass = graph.passes[graph.order[i]];
+        if (pass.active && !pass.active()) continue;
+        if (pass.timed) beginPass(profiler, pass.name.c_str());
+        pass.execute();
+        if (pass.timed) endPass(profiler);
+    }
+}
+
+// --vertex-bench: draws one globe many times in each vertex format into an
+// 8x8 target, where the few fragments leave vertex fetch and vertex shading
+// as the cost. GL_RASTERIZER_DISCARD would be cleaner, but lets drivers
+// (llvmpipe) skip the vertex stage altogether. The fetched bytes assume every
+// vertex shader run reads its vertex once, using the same cache model as
+// reportGlobe.
+void runVertexBenchmark(int res, bool optimize, int instances, int repeats) {
+    Globe globe = makeGlobe(5.0f, res, optimize);
+    size_t vertices = globe.vertices.size() / 5;
+    size_t shaded = countVertexInvocations(globe.indices, 32) * instances;
+    printf("Vertex bench: %zu vertices, %zu indices, %d instances, about %zu vertex shader runs per draw\n",
+        vertices, globe.indices.size(), instances, shaded);
+
+    FrameUniforms frame;
+    frame.view = glm::lookAt(glm::vec3(0.0f, 0.0f, 200.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    frame.proj = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 1.0f, 1000.0f);
+    frame.lightColor = glm::vec4(1.0f);
+    frame.lightPos = glm::vec4(0.0f);
+    frame.viewPos = glm::vec4(0.0f, 0.0f, 200.0f, 1.0f);
+    GLuint frameUbo;
+    glGenBuffers(1, &frameUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), &frame, GL_STATIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, frameBlockBinding, frameUbo);
+
+    // a square grid of globes in front of the camera
+    int side = (int) ceil(sqrt((double) instances));
+    std::vector<InstanceData> data(instances);
+    for (int i = 0; i < instances; i++) {
+        glm::vec3 position((i % side - side * 0.5f) * 12.0f, (i / side - side * 0.5f) * 12.0f, 0.0f);
+        data[i].model = glm::translate(glm::mat4(1.0f), position);
+        data[i].layer = 0.0f;
+        data[i].radius = globe.radius;
+        data[i].fade = 0.0f;
+    }
+    GLuint instanceVbo;
+    glGenBuffers(1, &instanceVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+    glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(InstanceData), &data[0], GL_STATIC_DRAW);
+
+    GLuint fragmentShader = makeShader(GL_FRAGMENT_SHADER, shadowFSource);
+    GLenum indexType = vertices > 65536 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+    RenderTarget target = makeRenderTarget(8, 8);
+    glViewport(0, 0, target.width, target.height);
+    for (int f = VERTEX_FLOAT; f <= VERTEX_UV; f++) {
+        VertexFormat format = (VertexFormat) f;
+        MeshArena arena = makeMeshArena(vertices, globe.indices.size(), indexType, format);
+        int mesh = addMesh(arena, globe);
+        // makeMeshArena binds buffers behind the state cache's back
+        resetGLState();
+        attachInstanceBuffer(arena, instanceVbo);
+        GLuint vertexShader = makeMeshShader(vertexSource, format);
+        ShaderProgram program = linkProgram(vertexShader, fragmentShader);
+        useProgram(program.id);
+        bindVertexArray(arena.vao);
+        drawMeshInstanced(arena, mesh, instanceVbo, 0, instances); // warm-up
+        glFinish();
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for (int r = 0; r < repeats; r++) drawMeshInstanced(arena, mesh, instanceVbo, 0, instances);
+        glFinish();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / repeats;
+        printf("  %-6s %2zu bytes/vertex, %7.1f KiB mesh, %8.3f ms per draw, %8.1f M vertices/s, %6.2f GB/s vertex fetch\n",
+            vertexFormatNames[format], arena.vertexSize, vertices * arena.vertexSize / 1024.0, ms,
+            shaded / ms / 1.0e3, shaded * arena.vertexSize / ms / 1.0e6);
+
+        glDeleteProgram(program.id);
+        glDeleteShader(vertexShader);
+        deleteMeshArena(arena);
+        resetGLState();
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    deleteRenderTarget(target);
+    glDeleteShader(fragmentShader);
+    glDeleteBuffers(1, &instanceVbo);
+    glDeleteBuffers(1, &frameUbo);
+}
+
+int main(int argc, char *argv[]) {
+    bool optimizeCache = true;
+    bool headless = false;
+    int headlessFrames = 100;
+    std::string outDir = "frames";
+    std::string outFormat = "ppm";
+    const char* profileCsv = NULL;
+    const char* profileTrace = NULL;
+    float impostorPx = 12.0f;
+    int lodLevels = 5;
+    LodSettings lod = { 6.0f, 0.25f };
+    bool occlusionQueries = false;
+    size_t streamBudget = 8 << 20;
+    const char* textureFormat = NULL; // DXT1 when the driver has it
+    float anisotropy = 16.0f;
+    bool textureCompare = false;
+    const char* vtBuildSource = NULL;
+    const char* vtBuildPack = NULL;
+    const char* vtPack = NULL;
+    int vtBudget = 8;
+    int vtAtlasTiles = 16;
+    int jobThreads = std::max(0, (int) std::thread::hardware_concurrency() - 1);
+    HdrSettings hdrSettings = { false, 6, 1.0f, 0.5f, 0.3f, 1.0f, 8.0f };
+    bool shadows = false;
+    int shadowSize = 2048;
+    int width = 800;
+    int height = 600;
+    Pacing pacing = PACING_VSYNC;
+    double targetFps = 0.0;
+    int benchBodies = 0;
+    int benchFrames = 500;
+    VertexFormat vertexFormat = VERTEX_PACKED;
+    int vertexBenchInstances = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-vcache-opt") == 0) optimizeCache = false;
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) benchBodies = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bench-frames") == 0 && i + 1 < argc) benchFrames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--headless") == 0) headless = true;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) headlessFrames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) outDir = argv[++i];
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) outFormat = argv[++i];
+        else if (strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc) profileCsv = argv[++i];
+        else if (strcmp(argv[i], "--profile-trace") == 0 && i + 1 < argc) profileTrace = argv[++i];
+        else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "adaptive") == 0) pacing = PACING_ADAPTIVE;
+            else if (strcmp(argv[i], "uncapped") == 0) pacing = PACING_UNCAPPED;
+            else if (strcmp(argv[i], "vsync") == 0) pacing = PACING_VSYNC;
+            else {
+                printf("Unknown pacing %s, expected vsync, adaptive or uncapped.\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) targetFps = atof(argv[++i]);
+        else if (strcmp(argv[i], "--impostor-px") == 0 && i + 1 < argc) impostorPx = atof(argv[++i]);
+        else if (strcmp(argv[i], "--lod-levels") == 0 && i + 1 < argc) lodLevels = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--lod-edge-px") == 0 && i + 1 < argc) lod.edgePx = atof(argv[++i]);
+        else if (strcmp(argv[i], "--lod-fade") == 0 && i + 1 < argc) lod.fadeBand = atof(argv[++i]);
+        else if (strcmp(argv[i], "--occlusion") == 0) occlusionQueries = true;
+        else if (strcmp(argv[i], "--stream-budget") == 0 && i + 1 < argc) streamBudget = (size_t) atof(argv[++i]) * 1024;
+        else if (strcmp(argv[i], "--texture-format") == 0 && i + 1 < argc) textureFormat = argv[++i];
+        else if (strcmp(argv[i], "--aniso") == 0 && i + 1 < argc) anisotropy = atof(argv[++i]);
+        else if (strcmp(argv[i], "--texture-compare") == 0) textureCompare = true;
+        else if (strcmp(argv[i], "--vt-build") == 0 && i + 2 < argc) {
+            vtBuildSource = argv[++i];
+            vtBuildPack = argv[++i];
+        }
+        else if (strcmp(argv[i], "--vt") == 0 && i + 1 < argc) vtPack = argv[++i];
+        else if (strcmp(argv[i], "--vt-budget") == 0 && i + 1 < argc) vtBudget = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) jobThreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--vt-atlas") == 0 && i + 1 < argc) vtAtlasTiles = std::min(256, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--hdr") == 0) hdrSettings.enabled = true;
+        else if (strcmp(argv[i], "--bloom-levels") == 0 && i + 1 < argc) hdrSettings.bloomLevels = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--bloom-threshold") == 0 && i + 1 < argc) hdrSettings.threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "--bloom-strength") == 0 && i + 1 < argc) hdrSettings.bloomStrength = atof(argv[++i]);
+        else if (strcmp(argv[i], "--exposure") == 0 && i + 1 < argc) hdrSettings.exposure = atof(argv[++i]);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            i++;
+            int w, h;
+            if (sscanf(argv[i], "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+                printf("--size expects WIDTHxHEIGHT, got %s.\n", argv[i]);
+                return 1;
+            }
+            width = w;
+            height = h;
+        }
+        else if (strcmp(argv[i], "--shadows") == 0) shadows = true;
+        else if (strcmp(argv[i], "--vertex-format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "float") == 0) vertexFormat = VERTEX_FLOAT;
+            else if (strcmp(argv[i], "uv") == 0) vertexFormat = VERTEX_UV;
+            else if (strcmp(argv[i], "packed") == 0) vertexFormat = VERTEX_PACKED;
+            else {
+                printf("Unknown vertex format %s, expected float, packed or uv.\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--vertex-bench") == 0 && i + 1 < argc) vertexBenchInstances = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--shadow-size") == 0 && i + 1 < argc) shadowSize = std::max(16, atoi(argv[++i]));
+    }
+    if (lodLevels > maxLodLevels(6)) {
+        printf("--lod-levels is limited to %d with 16-bit indices.\n", maxLodLevels(6));
+        lodLevels = maxLodLevels(6);
+    }
+    // 120 texel tiles with a 4 texel border fill 128x128 atlas slots
+    if (vtBuildSource) return buildVirtualTexturePack(vtBuildSource, vtBuildPack, 120, 4) ? 0 : 1;
+    // benchmarks measure throughput, so they never wait for a refresh
+    if (benchBodies) pacing = PACING_UNCAPPED;
+
+    SDL_Window* window = NULL;
+    SDL_GLContext context = NULL;
+#ifdef HEADLESS_EGL
+    HeadlessContext headlessContext;
+#endif
+    if (headless) {
+#ifdef HEADLESS_EGL
+        if (!createHeadlessContext(headlessContext)) return 1;
+#else
+        printf("--headless needs a build with HEADLESS_EGL (make test-headless).\n");
+        return 1;
+#endif
+    }
+    else {
+        SDL_Init(SDL_INIT_VIDEO);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
+        SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
+        window = SDL_CreateWindow("OpenGL", 100, 100, width, height, SDL_WINDOW_OPENGL);
+        context = SDL_GL_CreateContext(window);
+        applyPacing(pacing);
+    }
+    glewExperimental = GL_TRUE;
+    GLenum glewStatus = glewInit();
+    // GLEW built for GLX reports a missing X display after loading the core
+    // entry points; under EGL that is expected and harmless.
+    if (glewStatus != GLEW_OK && !(headless && glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)) {
+        printf("glewInit failed: %s\n", glewGetErrorString(glewStatus));
+        return 1;
+    }
+    glGetError(); // glewInit can leave GL_INVALID_ENUM behind on core contexts
+    SDL_Event windowEvent;
+
+    if (vertexBenchInstances) {
+        // the finest LOD level, the mesh where vertex cost matters most
+        runVertexBenchmark(6 << (lodLevels - 1), optimizeCache, vertexBenchInstances, 20);
+        if (headless) {
+#ifdef HEADLESS_EGL
+            destroyHeadlessContext(headlessContext);
+#endif
+        }
+        else {
+            SDL_GL_DeleteContext(context);
+            SDL_Quit();
+        }
+        return 0;
+    }
+
+    RenderTarget offscreen;
+    FrameCapture capture;
+    if (headless) {
+        offscreen = makeRenderTarget(width, height);
+        glViewport(0, 0, width, height);
+        startCapture(capture, outDir, outFormat, width, height);
+    }
+
+    MeshArena arena = makeMeshArena(1 << 18, 1 << 20, GL_UNSIGNED_SHORT, vertexFormat);
+    printf("Vertex format %s, %zu bytes per vertex\n", vertexFormatNames[vertexFormat], arena.vertexSize);
+    std::vector<LodChain> chains;
+    chains.push_back(makeLodChain(arena, "earth", 5.0, 6, lodLevels, optimizeCache));
+    chains.push_back(makeLodChain(arena, "moon", 2.5, 6, lodLevels, optimizeCache));
+    chains.push_back(makeLodChain(arena, "sun", 6.0, 6, lodLevels, optimizeCache));
+    int earthGlobe = 0, moonGlobe = 1, sunGlobe = 2;
+    int quadMesh = addMesh(arena, makeQuad());
+
+    GLuint instanceVbo;
+    glGenBuffers(1, &instanceVbo);
+    size_t instanceCapacity = 0;
+    attachInstanceBuffer(arena, instanceVbo);
+
+    GLuint vertexShader = makeMeshShader(vertexSource, vertexFormat);
+    GLuint fragmentShader = makeShader(GL_FRAGMENT_SHADER, fragmentSource);
+    GLuint sunVShader = makeMeshShader(sunVSource, vertexFormat);
+    GLuint sunFShader = makeShader(GL_FRAGMENT_SHADER, sunFSource);
+    GLuint impostorVShader = makeMeshShader(impostorVSource, vertexFormat);
+    GLuint impostorFShader = makeShader(GL_FRAGMENT_SHADER, impostorFSource);
+
+    ShaderProgram shaderProgram = linkProgram(vertexShader, fragmentShader);
+    ShaderProgram sunProgram = linkProgram(sunVShader, sunFShader);
+    ShaderProgram impostorProgram = linkProgram(impostorVShader, impostorFShader);
+    ShaderProgram* programs[] = { &shaderProgram, &sunProgram, &impostorProgram };
+    const int bodiesPassId = 0, sunPassId = 1;
+    std::vector<DrawTraits> drawTraits;
+    drawTraits.push_back({ bodiesPassId, 1 });
+    drawTraits.push_back({ sunPassId, 0 });
+    drawTraits.push_back({ bodiesPassId, 1 });
+    GLuint feedbackShader = makeShader(GL_FRAGMENT_SHADER, feedbackFSource);
+    ShaderProgram feedbackProgram = linkProgram(vertexShader, feedbackShader);
+
+    // with --hdr the scene renders into a float target that the post passes
+    // resolve with bloom and tonemapping; without it straight into the output
+    HdrTarget hdr;
+    PostPrograms post;
+    GLuint postVShader = 0, bloomDownShader = 0, bloomUpShader = 0, tonemapShader = 0;
+    if (hdrSettings.enabled) {
+        if (!makeHdrTarget(hdr, width, height, hdrSettings.bloomLevels)) return 1;
+        postVShader = makeShader(GL_VERTEX_SHADER, postVSource);
+        bloomDownShader = makeShader(GL_FRAGMENT_SHADER, bloomDownFSource);
+        bloomUpShader = makeShader(GL_FRAGMENT_SHADER, bloomUpFSource);
+        tonemapShader = makeShader(GL_FRAGMENT_SHADER, tonemapFSource);
+        post.down = linkProgram(postVShader, bloomDownShader);
+        post.up = linkProgram(postVShader, bloomUpShader);
+        post.tonemap = linkProgram(postVShader, tonemapShader);
+        post.downTexel = uniformLocation(post.down, "texel");
+        post.downThreshold = uniformLocation(post.down, "threshold");
+        post.upTexel = uniformLocation(post.up, "texel");
+        glUseProgram(post.down.id);
+        setUniform(post.down, uniformLocation(post.down, "source"), (int) (postSourceUnit - GL_TEXTURE0));
+        setUniform(post.down, uniformLocation(post.down, "knee"), hdrSettings.knee);
+        glUseProgram(post.up.id);
+        setUniform(post.up, uniformLocation(post.up, "source"), (int) (postSourceUnit - GL_TEXTURE0));
+        glUseProgram(post.tonemap.id);
+        setUniform(post.tonemap, uniformLocation(post.tonemap, "scene"), (int) (postSourceUnit - GL_TEXTURE0));
+        setUniform(post.tonemap, uniformLocation(post.tonemap, "bloom"), (int) (postBloomUnit - GL_TEXTURE0));
+        setUniform(post.tonemap, uniformLocation(post.tonemap, "exposure"), hdrSettings.exposure);
+        setUniform(post.tonemap, uniformLocation(post.tonemap, "bloomStrength"), hdrSettings.bloomStrength);
+        printf("HDR %dx%d: RGBA16F scene, %zu bloom levels down to %dx%d, about %.1f MiB of post traffic per frame\n",
+            width, height, hdr.bloomSizes.size(), hdr.bloomSizes.back().x, hdr.bloomSizes.back().y,
+            postTraffic(hdr) / 1048576.0);
+    }
+    glUseProgram(sunProgram.id);
+    setUniform(sunProgram, uniformLocation(sunProgram, "emission"), hdrSettings.enabled ? hdrSettings.sunEmission : 1.0f);
+
+    // --shadows renders a depth map from the light before the bodies pass
+    ShadowMap shadowMap;
+    ShaderProgram shadowProgram;
+    GLuint shadowVShader = 0, shadowFShader = 0;
+    if (shadows) {
+        if (!makeShadowMap(shadowMap, shadowSize)) return 1;
+        shadowVShader = makeMeshShader(shadowVSource, vertexFormat);
+        shadowFShader = makeShader(GL_FRAGMENT_SHADER, shadowFSource);
+        shadowProgram = linkProgram(shadowVShader, shadowFShader);
+    }
+    GLint lightViewProjLocation = shadows ? uniformLocation(shadowProgram, "lightViewProj") : -1;
+    GLint shadowMatrixLocation = uniformLocation(shaderProgram, "shadowMatrix");
+    glUseProgram(shaderProgram.id);
+    // like the virtual texture samplers, set even when unused
+    setUniform(shaderProgram, uniformLocation(shaderProgram, "shadowMap"), (int) (shadowUnit - GL_TEXTURE0));
+    setUniform(shaderProgram, uniformLocation(shaderProgram, "shadows"), shadows ? 1 : 0);
+    setUniform(shaderProgram, uniformLocation(shaderProgram, "shadowTexel"), glm::vec2(1.0f / shadowSize));
+    glm::mat4 lightViewProj(1.0f);
+
+    const char* textureFiles[] = { "earth.jpg", "moon.jpg" };
+    bool canCompress = GLEW_EXT_texture_compression_s3tc != 0;
+    float maxAnisotropy = 1.0f;
+    if (GLEW_EXT_texture_filter_anisotropic) glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+    anisotropy = std::max(1.0f, std::min(anisotropy, maxAnisotropy));
+    // --texture-compare streams every variant and alternates between them per
+    // frame, so the profile shows each one's bodies pass side by side
+    std::vector<TextureSettings> textureModes;
+    if (textureCompare) {
+        TextureSettings nearest = { "nearest", false, GL_NEAREST, 1.0f };
+        TextureSettings rgb8 = { "rgb8", false, GL_LINEAR_MIPMAP_LINEAR, anisotropy };
+        TextureSettings dxt1 = { "dxt1", true, GL_LINEAR_MIPMAP_LINEAR, anisotropy };
+        textureModes.push_back(nearest);
+        textureModes.push_back(rgb8);
+        if (canCompress) textureModes.push_back(dxt1);
+    }
+    else {
+        bool compress = textureFormat ? strcmp(textureFormat, "dxt1") == 0 : canCompress;
+        if (compress && !canCompress) {
+            printf("DXT1 textures not supported, using RGB8.\n");
+            compress = false;
+        }
+        TextureSettings settings = { compress ? "dxt1" : "rgb8", compress, GL_LINEAR_MIPMAP_LINEAR, anisotropy };
+        textureModes.push_back(settings);
+    }
+
+    auto t_stream = std::chrono::high_resolution_clock::now();
+    std::vector<TextureStreamer*> streamers;
+    for (size_t i = 0; i < textureModes.size(); i++) {
+        TextureStreamer* streamer = new TextureStreamer;
+        startStreamer(*streamer, textureFiles, 2, GL_TEXTURE0, textureModes[i]);
+        printf("Texture array %s: %dx%dx%d, %d levels, %.2f MiB (RGB8 %.2f MiB, DXT1 %.2f MiB), %gx anisotropy\n",
+            textureModes[i].label, streamer->width, streamer->height, streamer->layers, streamer->levelCount,
+            textureFootprint(*streamer, textureModes[i].compress) / 1048576.0, textureFootprint(*streamer, false) / 1048576.0,
+            textureFootprint(*streamer, true) / 1048576.0, textureModes[i].anisotropy);
+        streamers.push_back(streamer);
+    }
+    // captured frames should not depend on decode speed
+    resetGLState();
+    bool streaming = true;
+    while (headless && streaming) {
+        streaming = false;
+        size_t uploaded = 0;
+        for (size_t i = 0; i < streamers.size(); i++) {
+            uploaded += pumpStreamer(*streamers[i], (size_t) -1);
+            streaming = streaming || !streamerIdle(*streamers[i]);
+        }
+        if (streaming && !uploaded) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bool streamReported = false;
+    long textureFrame = 0;
+    glUseProgram(shaderProgram.id);
+    setUniform(shaderProgram, uniformLocation(shaderProgram, "textures"), 0);
+    glUseProgram(impostorProgram.id);
+    setUniform(impostorProgram, uniformLocation(impostorProgram, "textures"), 0);
+
+    // the earth layer can come from a virtual texture instead of the array;
+    // impostors are small enough to keep using the array
+    const int feedbackScale = 8;
+    GLuint outputFbo = headless ? offscreen.fbo : 0;
+    GLuint sceneFbo = hdrSettings.enabled ? hdr.fbo : outputFbo;
+    VirtualTexture vt;
+    bool virtualTexture = vtPack && openVirtualTexture(vt, vtPack, vtAtlasTiles, 0, width / feedbackScale, height / feedbackScale);
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFbo);
+    glUseProgram(shaderProgram.id);
+    setUniform(shaderProgram, uniformLocation(shaderProgram, "vtLayer"), virtualTexture ? vt.layer : -1);
+    // set even when unused: samplers of different types left on unit 0 with
+    // the array make every draw fail
+    setUniform(shaderProgram, uniformLocation(shaderProgram, "vtAtlas"), 1);
+    setUniform(shaderProgram, uniformLocation(shaderProgram, "vtIndirection"), 2);
+    if (virtualTexture) {
+        glm::vec4 vtInfo(vt.header.tilesX, vt.header.tilesY, vt.header.content, vt.header.border);
+        setUniform(shaderProgram, uniformLocation(shaderProgram, "vtInfo"), vtInfo);
+        glm::vec2 vtExtent((float) vt.header.width / (vt.header.tilesX * vt.header.content),
+            (float) vt.header.height / (vt.header.tilesY * vt.header.content));
+        setUniform(shaderProgram, uniformLocation(shaderProgram, "vtExtent"), vtExtent);
+        setUniform(shaderProgram, uniformLocation(shaderProgram, "vtAtlasSize"), (float) (vt.atlasTiles * vt.tileSize));
+        setUniform(shaderProgram, uniformLocation(shaderProgram, "vtMaxLevel"), (float) (vt.header.levels - 1));
+        glUseProgram(feedbackProgram.id);
+        setUniform(feedbackProgram, uniformLocation(feedbackProgram, "vtLayer"), vt.layer);
+        setUniform(feedbackProgram, uniformLocation(feedbackProgram, "vtInfo"), vtInfo);
+        setUniform(feedbackProgram, uniformLocation(feedbackProgram, "vtExtent"), vtExtent);
+        setUniform(feedbackProgram, uniformLocation(feedbackProgram, "vtMaxLevel"), (float) (vt.header.levels - 1));
+        setUniform(feedbackProgram, uniformLocation(feedbackProgram, "vtLodBias"), -log2f((float) feedbackScale));
+        printf("Virtual texture %s: %dx%d tiles, %d levels, %d atlas slots\n", vtPack, vt.header.tilesX, vt.header.tilesY,
+            vt.header.levels, vt.atlasTiles * vt.atlasTiles);
+    }
+
+    glm::vec3 lightColor(0.95f, 1.0f, 0.81f);
+    glm::vec3 lightPos(20.0f, 800.0f, 1.0f);
+    glm::vec3 viewPos(50.0f, 50.1f, 1.4f);
+
+    std::vector<Body> bodies;
+    Body earth = { 0, earthGlobe, 0.0f, glm::vec3(0.0f), 0.0f, 1.0f, 0.0f };
+    Body moon = { 0, moonGlobe, 1.0f, glm::vec3(36.0f, 0.0f, 0.0f), 0.0f, -0.4f, 0.0f };
+    Body sun = { 1, sunGlobe, 0.0f, lightPos, 0.0f, 0.0f, 0.0f };
+    bodies.push_back(earth);
+    bodies.push_back(moon);
+    bodies.push_back(sun);
+    // keep the field below the light so a single shadow direction covers it
+    spawnBenchBodies(bodies, benchBodies, earthGlobe, moonGlobe, lightPos.y * 0.5f);
+    BatchBuilder batchBuilder;
+    batchBuilder.meshCount = (int) arena.meshes.size();
+    OcclusionState occlusion;
+    initOcclusion(occlusion, occlusionQueries, bodies.size());
+    size_t queryFirst = 0;
+    std::vector<InstanceData> instances;
+    std::vector<DrawBatch> batches;
+    std::vector<DrawBatch> shadowCasters;
+
+    glm::mat4 view = glm::lookAt(
+        viewPos,
+        glm::vec3(0.0f, 0.0f, 0.0f),
+        glm::vec3(0.0f, 0.0f, 1.0f)
+    );
+
+    glm::mat4 proj = glm::perspective(glm::radians(55.0f), (float) width / height, 0.1f, 1000.0f);
+    ImpostorSettings impostors = { impostorPx > 0.0f ? 2 : -1, quadMesh, impostorPx, proj[1][1] * height * 0.5f };
+
+    bool rotate = benchBodies > 0 || headless;
+    double accumulator = 0.0;
+    auto t_last = std::chrono::high_resolution_clock::now();
+    auto nextDeadline = t_last;
+    glEnable(GL_DEPTH_TEST);
+
+    GLuint frameUbo;
+    glGenBuffers(1, &frameUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, frameBlockBinding, frameUbo);
+    FrameUniforms uploadedFrame;
+    memset(&uploadedFrame, 0, sizeof(uploadedFrame));
+    FrameUniforms frame;
+
+    unsigned long frames = 0;
+    unsigned long totalGlCalls = 0;
+    std::vector<float> benchTimes;
+    auto t_frame = std::chrono::high_resolution_clock::now();
+
+    // measure the real vertex shader count of the first frame where the driver can
+    GLuint statsQuery = 0;
+    if (GLEW_ARB_pipeline_statistics_query) {
+        glGenQueries(1, &statsQuery);
+    }
+    bool firstFrame = true;
+    Profiler profiler;
+    initProfiler(profiler, profileCsv || profileTrace);
+
+    JobPool jobs;
+    startJobPool(jobs, jobThreads);
+
+    // state the passes below read each frame
+    const TextureStreamer* textureSet = streamers[0];
+    // batches arrive sorted by pass first, so each pass is a contiguous run;
+    // the state cache drops the binds that repeat between neighbours
+    auto drawBatches = [&](int pass) {
+        for (size_t i = 0; i < batches.size(); i++) {
+            if (sortKeyPass(batches[i].key) != pass) continue;
+            useProgram(programs[batches[i].program]->id);
+            if (drawTraits[batches[i].program].textureSet) bindTexture(textureSet->unit, GL_TEXTURE_2D_ARRAY, textureSet->texture);
+            bindVertexArray(arena.vao);
+            drawMeshInstanced(arena, batches[i].mesh, instanceVbo, batches[i].first, batches[i].count);
+        }
+    };
+
+    RenderGraph graph;
+    graph.inputs.push_back("packets");
+    graph.outputs.push_back("output");
+    graph.outputs.push_back("visibility"); // read back by next frame's culling
+    addPass(graph, "upload", {}, { "textures" }, [&]() {
+        for (size_t i = 0; i < streamers.size(); i++) {
+            if (!streamerIdle(*streamers[i])) pumpStreamer(*streamers[i], streamBudget);
+        }
+    }, [&]() {
+        for (size_t i = 0; i < streamers.size(); i++) if (!streamerIdle(*streamers[i])) return true;
+        return false;
+    });
+    addPass(graph, "feedback", { "packets" }, { "vt tiles" }, [&]() {
+        GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, vt.feedbackFbo));
+        GLCALL(glViewport(0, 0, vt.feedbackWidth, vt.feedbackHeight));
+        const GLuint noTile[4] = { 0, 0, 0, 0 };
+        GLCALL(glClearBufferuiv(GL_COLOR, 0, noTile));
+        GLCALL(glClear(GL_DEPTH_BUFFER_BIT));
+        useProgram(feedbackProgram.id);
+        bindVertexArray(arena.vao);
+        for (size_t i = 0; i < batches.size(); i++) {
+            if (batches[i].program != 0) continue;
+            drawMeshInstanced(arena, batches[i].mesh, instanceVbo, batches[i].first, batches[i].count);
+        }
+        updateVirtualTexture(vt, vtBudget);
+        GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, sceneFbo));
+        GLCALL(glViewport(0, 0, width, height));
+    }, [&]() { return virtualTexture; });
+    std::vector<std::string> bodiesReads = { "packets", "textures", "vt tiles" };
+    if (shadows) {
+        bodiesReads.push_back("shadow map");
+        addPass(graph, "shadow", { "packets" }, { "shadow map" }, [&]() {
+            GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, shadowMap.fbo));
+            GLCALL(glViewport(0, 0, shadowMap.size, shadowMap.size));
+            GLCALL(glClear(GL_DEPTH_BUFFER_BIT));
+            // slope-scaled offset keeps lit surfaces from shadowing themselves
+            GLCALL(glEnable(GL_POLYGON_OFFSET_FILL));
+            GLCALL(glPolygonOffset(2.0f, 4.0f));
+            useProgram(shadowProgram.id);
+            setUniform(shadowProgram, lightViewProjLocation, lightViewProj);
+            bindVertexArray(arena.vao);
+            for (size_t i = 0; i < shadowCasters.size(); i++) {
+                drawMeshInstanced(arena, shadowCasters[i].mesh, instanceVbo, shadowCasters[i].first, shadowCasters[i].count);
+            }
+            GLCALL(glDisable(GL_POLYGON_OFFSET_FILL));
+            GLCALL(glViewport(0, 0, width, height));
+            // maps light clip space to shadow map texture coordinates and depth
+            glm::mat4 toTexture = glm::translate(glm::mat4(1.0f), glm::vec3(0.5f)) * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f));
+            useProgram(shaderProgram.id);
+            setUniform(shaderProgram, shadowMatrixLocation, toTexture * lightViewProj);
+            bindTexture(shadowUnit, GL_TEXTURE_2D, shadowMap.texture);
+        });
+    }
+    size_t bodiesPass = addPass(graph, "bodies", bodiesReads, { "scene" }, [&]() {
+        GLCALL(glBindFramebuffer(GL_FRAMEBUFFER, sceneFbo));
+        GLCALL(glClearColor(0.0f, 0.0f, 0.0f, 1.0f));
+        GLCALL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+        drawBatches(bodiesPassId);
+    });
+    addPass(graph, "sun", { "packets", "scene" }, { "scene" }, [&]() { drawBatches(sunPassId); });
+    addPass(graph, "occlusion", { "packets", "scene" }, { "visibility" }, [&]() {
+        useProgram(impostorProgram.id);
+        bindVertexArray(arena.vao);
+        GLCALL(glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE));
+        GLCALL(glDepthMask(GL_FALSE));
+        GLCALL(glDepthFunc(GL_LEQUAL));
+        for (size_t i = 0; i < batchBuilder.queryBodies.size(); i++) {
+            size_t body = batchBuilder.queryBodies[i];
+            GLCALL(glBeginQuery(occlusion.target, occlusion.queries[body]));
+            drawMeshInstanced(arena, quadMesh, instanceVbo, queryFirst + i, 1);
+            GLCALL(glEndQuery(occlusion.target));
+            occlusion.pending[body] = 1;
+        }
+        GLCALL(glDepthFunc(GL_LESS));
+        GLCALL(glDepthMask(GL_TRUE));
+        GLCALL(glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE));
+    }, [&]() { return occlusion.enabled && !batchBuilder.queryBodies.empty(); });
+    // what capture and present show
+    const char* displayImage = hdrSettings.enabled ? "display" : "scene";
+    if (hdrSettings.enabled) {
+        addPass(graph, "bloom down", { "scene" }, { "bloom chain" }, [&]() { bloomDownsample(hdr, post, hdrSettings); });
+        addPass(graph, "bloom up", { "bloom chain" }, { "bloom" }, [&]() { bloomUpsample(hdr, post); });
+        addPass(graph, "tonemap", { "scene", "bloom" }, { "display" }, [&]() { tonemap(hdr, post, outputFbo); });
+    }
+    addPass(graph, "capture", { displayImage }, { "output" }, [&]() { captureFrame(capture); }, [&]() { return headless; });
+    addPass(graph, "present", { displayImage }, { "output" }, [&]() {
+        SDL_GL_SwapWindow(window);
+        frameStats.glCalls++;
+        if (targetFps > 0.0) {
+            nextDeadline += std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+                std::chrono::duration<double>(1.0 / targetFps));
+            // after a long frame, restart the schedule instead of rushing to catch up
+            if (nextDeadline < std::chrono::high_resolution_clock::now()) nextDeadline = std::chrono::high_resolution_clock::now();
+            waitUntil(nextDeadline);
+        }
+    }, [&]() { return !headless; }, false);
+    if (!compileRenderGraph(graph)) return 1;
+
+    // setup above bound programs, textures and buffers directly
+    resetGLState();
+    bool quit = false;
+    while (!quit) {
+        // drain everything queued so input never lags behind by several frames
+        while (!headless && SDL_PollEvent(&windowEvent)) {
+            if (windowEvent.type == SDL_QUIT) quit = true;
+            if (windowEvent.type == SDL_KEYUP) {
+                if (windowEvent.key.keysym.sym == SDLK_ESCAPE) quit = true;
+                if (windowEvent.key.keysym.sym == SDLK_SPACE) rotate = !rotate;
+            }
+        }
+        if (quit) break;
+
+        memset(&frameStats, 0, sizeof(frameStats));
+        beginProfiledFrame(profiler);
+        auto t_now = std::chrono::high_resolution_clock::now();
+        // headless output advances exactly one tick per frame so it is reproducible
+        if (headless) accumulator += simulationStep;
+        else accumulator += std::chrono::duration<double>(t_now - t_last).count();
+        t_last = t_now;
+        float alpha = stepSimulation(bodies, accumulator, rotate);
+
+        frame.view = view;
+        frame.proj = proj;
+        frame.lightColor = glm::vec4(lightColor, 1.0f);
+        frame.lightPos = glm::vec4(lightPos, 1.0f);
+        frame.viewPos = glm::vec4(viewPos, 1.0f);
+        updateFrameUniforms(frameUbo, uploadedFrame, frame);
+
+        // packets are built on the job pool; the GL thread only submits them
+        collectOcclusion(occlusion);
+        buildDrawBatches(jobs, batchBuilder, bodies, chains, alpha, view, extractFrustum(proj * view), occlusion,
+            impostors, lod, drawTraits, instances, batches, queryFirst);
+        if (shadows) {
+            float extent;
+            lightViewProj = fitShadowFrustum(batchBuilder, bodies, lightPos, extent);
+            buildShadowCasters(jobs, batchBuilder, bodies, chains, lod, shadowMap.size / extent, instances, shadowCasters);
+        }
+        uploadInstances(instanceVbo, instanceCapacity, instances);
+
+        textureSet = streamers[textureFrame++ % streamers.size()];
+        if (streamers.size() > 1) graph.passes[bodiesPass].name = std::string("bodies ") + textureSet->settings.label;
+
+        if (firstFrame && statsQuery) glBeginQuery(GL_VERTEX_SHADER_INVOCATIONS_ARB, statsQuery);
+        executeRenderGraph(graph, profiler);
+        if (firstFrame && statsQuery) {
+            glEndQuery(GL_VERTEX_SHADER_INVOCATIONS_ARB);
+            GLuint invocations = 0;
+            glGetQueryObjectuiv(statsQuery, GL_QUERY_RESULT, &invocations);
+            printf("Vertex shader invocations in the first frame: %u\n", invocations);
+        }
+        firstFrame = false;
+
+        bool streamed = true;
+        for (size_t i = 0; i < streamers.size(); i++) streamed = streamed && streamerIdle(*streamers[i]);
+        if (!streamReported && streamed) {
+            printf("Textures resident after %.1f ms\n",
+                std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_stream).count());
+            streamReported = true;
+        }
+        endProfiledFrame(profiler);
+        totalGlCalls += frameStats.glCalls;
+        frames++;
+
+        auto t_end = std::chrono::high_resolution_clock::now();
+        if (benchBodies) {
+            benchTimes.push_back(std::chrono::duration_cast<std::chrono::duration<float, std::milli>>(t_end - t_frame).count());
+            if ((int) benchTimes.size() >= benchFrames) break;
+        }
+        if (headless && (long) frames >= headlessFrames) break;
+        t_frame = t_end;
+        if (frames % 600 == 0) {
+            printf("GL calls last frame: %u (%u uniform uploads, %u skipped as redundant)\n",
+                frameStats.glCalls, frameStats.uniformUploads, frameStats.uniformsSkipped);
+        }
+    }
+
+    if (frames) printf("Average GL calls per frame: %.1f\n", (double) totalGlCalls / frames);
+    printProfile(profiler);
+    if (profileCsv) writeProfileCsv(profiler, profileCsv);
+    if (profileTrace) writeProfileTrace(profiler, profileTrace);
+    deleteProfiler(profiler);
+    if (!benchTimes.empty()) {
+        // the first frames include driver warm-up, skip them
+        size_t skip = benchTimes.size() / 10;
+        std::vector<float> times(benchTimes.begin() + skip, benchTimes.end());
+        std::sort(times.begin(), times.end());
+        double sum = 0.0;
+        for (size_t i = 0; i < times.size(); i++) sum += times[i];
+        double mean = sum / times.size();
+        printf("Bench: %zu bodies, %zu frames, mean %.3f ms, median %.3f ms, max %.3f ms (%.0f bodies/s)\n",
+            bodies.size(), times.size(), mean, times[times.size() / 2], times.back(), bodies.size() * 1000.0 / mean);
+    }
+
+    if (headless) {
+        finishCapture(capture);
+        deleteRenderTarget(offscreen);
+    }
+
+    stopJobPool(jobs);
+    deleteOcclusion(occlusion);
+    if (virtualTexture) {
+        printf("Virtual texture: %u tiles loaded, %u evicted, %zu resident\n", vt.tilesLoaded, vt.tilesEvicted, vt.resident.size());
+        deleteVirtualTexture(vt);
+    }
+    for (size_t i = 0; i < streamers.size(); i++) {
+        deleteStreamer(*streamers[i]);
+        delete streamers[i];
+    }
+    glDeleteBuffers(1, &instanceVbo);
+    glDeleteBuffers(1, &frameUbo);
+    glDeleteProgram(shaderProgram.id);
+    glDeleteProgram(sunProgram.id);
+    glDeleteProgram(impostorProgram.id);
+    glDeleteProgram(feedbackProgram.id);
+    glDeleteShader(feedbackShader);
+    if (hdrSettings.enabled) {
+        glDeleteProgram(post.down.id);
+        glDeleteProgram(post.up.id);
+        glDeleteProgram(post.tonemap.id);
+        glDeleteShader(postVShader);
+        glDeleteShader(bloomDownShader);
+        glDeleteShader(bloomUpShader);
+        glDeleteShader(tonemapShader);
+        deleteHdrTarget(hdr);
+    }
+    glDeleteShader(impostorFShader);
+    glDeleteShader(impostorVShader);
+    glDeleteShader(fragmentShader);
+    glDeleteShader(vertexShader);
+    glDeleteShader(sunFShader);
+    glDeleteShader(sunVShader);
+    if (shadows) {
+        glDeleteProgram(shadowProgram.id);
+        glDeleteShader(shadowVShader);
+        glDeleteShader(shadowFShader);
+        deleteShadowMap(shadowMap);
+    }
+    if (statsQuery) glDeleteQueries(1, &statsQuery);
+    deleteMeshArena(arena);
+
+    if (headless) {
+#ifdef HEADLESS_EGL
+        destroyHeadlessContext(headlessContext);
+#endif
+    }
+    else {
+        SDL_GL_DeleteContext(context);
+        SDL_Quit();
+    }
     return 0;
 }